@@ -0,0 +1,16 @@
+#include "cancel_token.h"
+
+/* creates an untriggered token */
+void cancel_token_init(cancel_token_t *token) {
+    token->cancelled = 0;
+}
+
+/* cancels, returns 1 if it was already cancelled */
+int cancel_token_fire(cancel_token_t *token) {
+    return __atomic_exchange_n(&token->cancelled, 1, __ATOMIC_SEQ_CST);
+}
+
+/* 1 if cancelled, 0 otherwise */
+int cancel_token_cancelled(cancel_token_t *token) {
+    return __atomic_load_n(&token->cancelled, __ATOMIC_ACQUIRE);
+}
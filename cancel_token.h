@@ -0,0 +1,24 @@
+
+/*
+   Cancellation request for a job.
+   The flag is checked by the printer before every step of the job;
+   the canceller pokes the printer's timer so the step comes right away.
+*/
+
+#ifndef _CANCEL_TOKEN_H_
+#define _CANCEL_TOKEN_H_
+
+typedef struct {
+    int     cancelled;  // 1 once cancelled (atomic)
+} cancel_token_t;
+
+/* creates an untriggered token */
+void cancel_token_init(cancel_token_t *token);
+
+/* cancels, returns 1 if it was already cancelled */
+int cancel_token_fire(cancel_token_t *token);
+
+/* 1 if cancelled, 0 otherwise */
+int cancel_token_cancelled(cancel_token_t *token);
+
+#endif
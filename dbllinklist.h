@@ -1,3 +1,5 @@
+#ifndef _DBLLINKLIST_H_
+#define _DBLLINKLIST_H_
 typedef struct list_head {
     struct list_head* next;
     struct list_head* prev;
@@ -23,4 +25,6 @@ void list_move(list_head_t *entry, list_head_t *head);
 void list_move_tail(list_head_t *entry, list_head_t *head);
 
 /* tests whether a list is empty */
-int list_empty(list_head_t *head);
\ No newline at end of file
+int list_empty(list_head_t *head);
+
+#endif
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "io_engine.h"
+#include "device_cache.h"
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static list_head_t lru = { &lru, &lru };   // Open idle devices, most recently used first
+static int max_open = 256;
+static int open_count = 0;
+static unsigned long long opens = 0;
+static unsigned long long reopens = 0;
+static unsigned long long evictions = 0;
+
+/* sets the number of devices that may stay open (at least 1) */
+void device_cache_init(int max) {
+    max_open = max > 0 ? max : 1;
+}
+
+/* sets up a closed device for a printer */
+void device_init(device_t *device, unsigned int printer_no) {
+    list_init(&device->lru_elem);
+    device->dev.fd = -1;
+    device->printer_no = printer_no;
+    device->open = 0;
+    device->busy = 0;
+    device->stale = 0;
+}
+
+/* closes an open device, cache locked; an idle one leaves the LRU list */
+static void close_device(device_t *device) {
+    if(!device->busy)
+        list_del(&device->lru_elem);
+    close_printer(&device->dev);
+    device->open = 0;
+    device->stale = 0;
+    open_count--;
+}
+
+/* closes the least recently used idle devices while too many are open, cache locked */
+static void evict(void) {
+    while(open_count > max_open && lru.prev != &lru) {
+        close_device((device_t*)lru.prev);
+        evictions++;
+    }
+}
+
+/* drops the output queued for a descriptor that failed, 1 if there was any */
+static int forget_lost(int fd) {
+    size_t len;
+    char *lost = io_write_lost(fd, &len);
+    free(lost);
+    return lost != NULL;
+}
+
+/* opens the device of a busy printer, counting it as open; 0 or -1 */
+static int open_device(device_t *device) {
+    // Opening may take a while, the cache stays usable meanwhile
+    if(open_printer(&device->dev, device->printer_no) == -1)
+        return -1;
+    // Failed writes of the descriptor's previous owner are none of its business
+    forget_lost(device->dev.fd);
+    pthread_mutex_lock(&cache_mutex);
+    device->open = 1;
+    open_count++;
+    evict();
+    pthread_mutex_unlock(&cache_mutex);
+    return 0;
+}
+
+/* opens the device if needed and keeps it open until released; 0 or -1 */
+/* Called by the printer's thread. */
+int device_acquire(device_t *device) {
+    pthread_mutex_lock(&cache_mutex);
+    if(device->busy) {
+        // Busy since a failed open: try again
+        int open = device->open;
+        if(!open)
+            opens++;
+        pthread_mutex_unlock(&cache_mutex);
+        return open ? 0 : open_device(device);
+    }
+    if(device->open && device->stale)
+        close_device(device);
+    if(device->open)
+        list_del(&device->lru_elem);
+    device->busy = 1;
+    int open = device->open;
+    if(!open)
+        opens++;
+    pthread_mutex_unlock(&cache_mutex);
+
+    return open ? 0 : open_device(device);
+}
+
+/* the printer is idle: the device may be closed from now on */
+/* Called by the printer's thread, after its last write. */
+void device_release(device_t *device) {
+    // Writes still queued by the I/O engine must reach the device before it can be closed
+    io_flush();
+    // A device that failed them is not worth keeping open
+    int failed = device->open && forget_lost(device->dev.fd);
+    pthread_mutex_lock(&cache_mutex);
+    if(!device->busy) {
+        pthread_mutex_unlock(&cache_mutex);
+        return;
+    }
+    device->busy = 0;
+    if(device->open) {
+        list_add(&device->lru_elem, &lru);
+        if(device->stale || failed)
+            close_device(device);
+        else
+            evict();
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/* closes an acquired device that failed and opens it afresh, then writes */
+/* the output the I/O engine queued for it but could not write; 0 or -1 */
+static int reopen_device(device_t *device) {
+    size_t lost_len = 0;
+    char *lost = NULL;
+
+    // Writes still queued must not go to the descriptor once it is closed
+    io_flush();
+    if(device->open)
+        lost = io_write_lost(device->dev.fd, &lost_len);
+    pthread_mutex_lock(&cache_mutex);
+    if(device->open)
+        close_device(device);
+    reopens++;
+    pthread_mutex_unlock(&cache_mutex);
+
+    int res = open_device(device);
+    if(res == 0 && lost_len) {
+        // This is its one retry: it has to reach the device now
+        res = print_text(&device->dev, lost, lost_len) == 1 ? 0 : -1;
+        io_flush();
+        if(forget_lost(device->dev.fd))
+            res = -1;
+    }
+    free(lost);
+    return res;
+}
+
+/* writes to an acquired device, reopening it once on error; 0 or -1 */
+int device_write(device_t *device, const char *buf, size_t len) {
+    // Output queued earlier fails only when the I/O engine submits it
+    if(device->open && !io_write_failed(device->dev.fd) && print_text(&device->dev, buf, len) == 1)
+        return 0;
+
+    // The device failed (or could not be opened): try it afresh
+    if(reopen_device(device) == -1)
+        return -1;
+    return print_text(&device->dev, buf, len) == 1 ? 0 : -1;
+}
+
+/* makes sure the output of an acquired device has been written, */
+/* reopening it once on error; 0 or -1 */
+int device_flush(device_t *device) {
+    io_flush();
+    if(device->open && !io_write_failed(device->dev.fd))
+        return 0;
+    return reopen_device(device);
+}
+
+/* the device vanished: closes it now or, if busy, when it is used or released next */
+void device_invalidate(device_t *device) {
+    pthread_mutex_lock(&cache_mutex);
+    if(device->busy)
+        device->stale = 1;
+    else if(device->open)
+        close_device(device);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/* current statistics */
+void device_cache_stats(device_cache_stats_t *stats) {
+    pthread_mutex_lock(&cache_mutex);
+    stats->open = open_count;
+    stats->max_open = max_open;
+    stats->opens = opens;
+    stats->reopens = reopens;
+    stats->evictions = evictions;
+    pthread_mutex_unlock(&cache_mutex);
+}
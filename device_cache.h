@@ -0,0 +1,66 @@
+
+/*
+   Open printer devices, bounded in number.
+   A printer's device is opened when the printer starts a job and stays
+   open while it is busy. Afterwards it waits in a least recently used
+   list and is closed as soon as more devices are open than allowed, so
+   idle printers give back their file descriptors. A device that fails
+   a write is opened again and the write retried once; a device that
+   vanished is closed and opened anew on its next use. Output the I/O
+   engine queued fails only when it is submitted: the next write or
+   flush of the device finds out and retries it on the reopened device.
+*/
+
+#ifndef _DEVICE_CACHE_H_
+#define _DEVICE_CACHE_H_
+
+#include <stddef.h>
+#include "dbllinklist.h"
+#include "printer_management.h"
+
+/* The device of a printer, owned by the printer */
+typedef struct {
+    list_head_t     lru_elem;   // Pointers into the LRU list while open and idle
+    printer_dev_t   dev;        // The backend device, fd -1 while closed
+    unsigned int    printer_no;
+    int             open;       // 1 while the device is open
+    int             busy;       // 1 while its printer prints (not evictable)
+    int             stale;      // 1 if the device vanished, reopened on the next use
+} device_t;
+
+typedef struct {
+    int                 open;       // Devices open
+    int                 max_open;   // Limit of open devices, only busy printers exceed it
+    unsigned long long  opens;      // Devices opened
+    unsigned long long  reopens;    // Attempts to open a device again after a failed write
+    unsigned long long  evictions;  // Idle devices closed to stay within the limit
+} device_cache_stats_t;
+
+/* sets the number of devices that may stay open (at least 1) */
+void device_cache_init(int max_open);
+
+/* sets up a closed device for a printer */
+void device_init(device_t *device, unsigned int printer_no);
+
+/* opens the device if needed and keeps it open until released; 0 or -1 */
+/* Called by the printer's thread. */
+int device_acquire(device_t *device);
+
+/* the printer is idle: the device may be closed from now on */
+/* Called by the printer's thread, after its last write. */
+void device_release(device_t *device);
+
+/* writes to an acquired device, reopening it once on error; 0 or -1 */
+int device_write(device_t *device, const char *buf, size_t len);
+
+/* makes sure the output of an acquired device has been written, */
+/* reopening it once on error; 0 or -1 */
+int device_flush(device_t *device);
+
+/* the device vanished: closes it now or, if busy, when it is used or released next */
+void device_invalidate(device_t *device);
+
+/* current statistics */
+void device_cache_stats(device_cache_stats_t *stats);
+
+#endif
@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "file_cache.h"
+
+/* Hash buckets for the cached paths */
+#define FILE_CACHE_BUCKETS 1024
+
+#ifdef __APPLE__
+#define MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+#define MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
+static list_head_t lru;                         // All cached entries, most recently used first
+static list_head_t buckets[FILE_CACHE_BUCKETS];
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static file_cache_stats_t cache_stats;
+
+
+static list_head_t* bucket(const char *path) {
+    unsigned int hash = 2166136261u;
+    while(*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619u;
+    }
+    return &buckets[hash % FILE_CACHE_BUCKETS];
+}
+
+static file_content_t* lookup(const char *path) {
+    list_head_t *head = bucket(path);
+    for(list_head_t *ptr = head->next; ptr != head; ptr = ptr->next) {
+        file_content_t *content = (file_content_t*)((char*)ptr - offsetof(file_content_t, hash_elem));
+        if(!strcmp(content->path, path))
+            return content;
+    }
+    return NULL;
+}
+
+static int same_version(file_content_t *content, struct stat *statbuf) {
+    return content->dev == statbuf->st_dev && content->ino == statbuf->st_ino
+        && content->size == statbuf->st_size && content->mtime == statbuf->st_mtime
+        && content->mtime_nsec == MTIME_NSEC(*statbuf);
+}
+
+static void free_content(file_content_t *content) {
+    file_map_close(&content->map);
+    free(content->path);
+    free(content);
+}
+
+/* takes an entry out of the cache, caller holds the mutex */
+static void uncache(file_content_t *content) {
+    list_del(&content->lru_elem);
+    list_del(&content->hash_elem);
+    content->cached = 0;
+    cache_stats.files--;
+    cache_stats.bytes -= content->map.len;
+    if(!content->refs)
+        free_content(content);
+}
+
+/* evicts unused entries until the cache fits, caller holds the mutex */
+static void shrink(void) {
+    list_head_t *ptr = lru.prev;
+    while(cache_stats.bytes > cache_stats.max_bytes && ptr != &lru) {
+        file_content_t *content = (file_content_t*)ptr;
+        ptr = ptr->prev;
+        if(!content->refs)
+            uncache(content);
+    }
+}
+
+/* reads the file and builds its index, NULL on error; statbuf becomes the version read */
+static file_content_t* load(const char *path, struct stat *statbuf) {
+    file_content_t *content = calloc(1, sizeof(file_content_t));
+    list_init(&content->lru_elem);
+    list_init(&content->hash_elem);
+    page_index_init(&content->index);
+    if(file_map_open(&content->map, path, statbuf) == -1) {
+        free(content);
+        return NULL;
+    }
+    page_index_build(&content->index, content->map.data, content->map.len);
+    content->path = strdup(path);
+    content->dev = statbuf->st_dev;
+    content->ino = statbuf->st_ino;
+    content->size = statbuf->st_size;
+    content->mtime = statbuf->st_mtime;
+    content->mtime_nsec = MTIME_NSEC(*statbuf);
+    content->refs = 1;
+    return content;
+}
+
+/* set up an empty cache of the given size */
+void file_cache_init(long long max_bytes) {
+    list_init(&lru);
+    for(int i = 0; i < FILE_CACHE_BUCKETS; i++)
+        list_init(&buckets[i]);
+    memset(&cache_stats, 0, sizeof(cache_stats));
+    cache_stats.max_bytes = max_bytes;
+}
+
+/* returns the content of the file (one reference) or NULL (errno set) */
+file_content_t* file_cache_get(const char *path) {
+    struct stat statbuf;
+    if(stat(path, &statbuf) == -1)
+        return NULL;
+
+    pthread_mutex_lock(&cache_mutex);
+    file_content_t *content = lookup(path);
+    if(content && same_version(content, &statbuf)) {
+        content->refs++;
+        list_move(&content->lru_elem, &lru);
+        cache_stats.hits++;
+        pthread_mutex_unlock(&cache_mutex);
+        return content;
+    }
+    if(content)
+        uncache(content);   // file has changed
+    cache_stats.misses++;
+    pthread_mutex_unlock(&cache_mutex);
+
+    // Read without holding the lock
+    content = load(path, &statbuf);
+    if(!content)
+        return NULL;
+
+    pthread_mutex_lock(&cache_mutex);
+    file_content_t *other = lookup(path);
+    if(other && same_version(other, &statbuf)) {
+        // Somebody else was faster
+        other->refs++;
+        pthread_mutex_unlock(&cache_mutex);
+        free_content(content);
+        return other;
+    }
+    if(other)
+        uncache(other);
+    if(content->map.len <= cache_stats.max_bytes) {
+        content->cached = 1;
+        list_add(&content->lru_elem, &lru);
+        list_add(&content->hash_elem, bucket(path));
+        cache_stats.files++;
+        cache_stats.bytes += content->map.len;
+        shrink();
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return content;
+}
+
+/* takes another reference, returns content */
+file_content_t* file_cache_ref(file_content_t *content) {
+    if(!content)
+        return NULL;
+    pthread_mutex_lock(&cache_mutex);
+    content->refs++;
+    pthread_mutex_unlock(&cache_mutex);
+    return content;
+}
+
+/* gives back a reference */
+void file_cache_put(file_content_t *content) {
+    if(!content)
+        return;
+    pthread_mutex_lock(&cache_mutex);
+    content->refs--;
+    if(!content->refs) {
+        if(!content->cached)
+            free_content(content);
+        else
+            shrink();
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/* current statistics */
+void file_cache_stats(file_cache_stats_t *stats) {
+    pthread_mutex_lock(&cache_mutex);
+    *stats = cache_stats;
+    pthread_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,56 @@
+
+/*
+   Cache of file contents and their page indices.
+   Entries are shared and reference counted; they are validated by
+   inode, size and modification time on every lookup. Unused entries
+   are evicted least recently used first when the cache exceeds its size.
+*/
+
+#ifndef _FILE_CACHE_H_
+#define _FILE_CACHE_H_
+
+#include <sys/types.h>
+#include "dbllinklist.h"
+#include "file_map.h"
+#include "page_index.h"
+
+/* Content of a file as printed, do not modify */
+typedef struct {
+    list_head_t     lru_elem;   // Pointers into the LRU list (most recent first)
+    list_head_t     hash_elem;  // Pointers into the hash bucket
+    char*           path;       // Path the file was looked up with
+    dev_t           dev;        // Identity and version of the file
+    ino_t           ino;
+    off_t           size;
+    time_t          mtime;
+    long            mtime_nsec;
+    int             refs;       // Users of the entry
+    int             cached;     // 1: entry is in the cache, 0: freed on last release
+    file_map_t      map;        // The content
+    page_index_t    index;      // How many lines it has
+} file_content_t;
+
+typedef struct {
+    int                 files;      // Cached files
+    long long           bytes;      // Cached bytes
+    long long           max_bytes;  // Cache size
+    unsigned long long  hits;       // Lookups served from the cache
+    unsigned long long  misses;     // Lookups that had to read the file
+} file_cache_stats_t;
+
+/* set up an empty cache of the given size */
+void file_cache_init(long long max_bytes);
+
+/* returns the content of the file (one reference) or NULL (errno set) */
+file_content_t* file_cache_get(const char *path);
+
+/* takes another reference, returns content */
+file_content_t* file_cache_ref(file_content_t *content);
+
+/* gives back a reference */
+void file_cache_put(file_content_t *content);
+
+/* current statistics */
+void file_cache_stats(file_cache_stats_t *stats);
+
+#endif
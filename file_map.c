@@ -0,0 +1,82 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "file_map.h"
+
+/* Block size for reading files */
+#define FILE_MAP_BLOCK (256 * 1024)
+
+/* reads everything from fd in large aligned blocks, expecting size bytes; 0 or -1 */
+static int read_all(file_map_t *map, int fd, long long size) {
+    char *buf = NULL;
+    long long len = 0;
+    // A block more than expected, so the end of the file is found without growing
+    long long capacity = (size / FILE_MAP_BLOCK + 1) * FILE_MAP_BLOCK;
+    ssize_t res;
+
+    while(1) {
+        if(!buf || len == capacity) {
+            char *bigger;
+            if(buf)
+                capacity *= 2;
+            if(posix_memalign((void**)&bigger, FILE_MAP_BLOCK, capacity)) {
+                free(buf);
+                errno = ENOMEM;
+                return -1;
+            }
+            if(buf) {
+                memcpy(bigger, buf, len);
+                free(buf);
+            }
+            buf = bigger;
+        }
+        res = read(fd, buf + len, capacity - len);
+        if(res == -1 && errno == EINTR)
+            continue;
+        if(res == -1) {
+            free(buf);
+            return -1;
+        }
+        if(res == 0)
+            break;
+        len += res;
+    }
+    map->data = buf;
+    map->len = len;
+    return 0;
+}
+
+/* read the file and fstat what was read into statbuf, returns 0 or -1 (errno set) */
+int file_map_open(file_map_t *map, const char *filename, struct stat *statbuf) {
+    int res = 0;
+
+    map->data = NULL;
+    map->len = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1)
+        return -1;
+    // The file as opened, a path may point elsewhere by now
+    if(fstat(fd, statbuf) == -1) {
+        close(fd);
+        return -1;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    // Never mapped: a file truncated under its mapping would kill the server with SIGBUS
+    res = read_all(map, fd, S_ISREG(statbuf->st_mode) ? statbuf->st_size : 0);
+    close(fd);
+    return res;
+}
+
+/* free the content */
+void file_map_close(file_map_t *map) {
+    free((void*)map->data);
+    map->data = NULL;
+    map->len = 0;
+}
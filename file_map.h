@@ -0,0 +1,25 @@
+
+/*
+   Read-only view of a whole input file.
+   Every file is read in large blocks into a buffer when it is opened,
+   so a job keeps printing what was submitted even if the file is
+   rewritten or truncated later.
+*/
+
+#ifndef _FILE_MAP_H_
+#define _FILE_MAP_H_
+
+#include <sys/stat.h>
+
+typedef struct {
+    const char* data;   // Content of the file
+    long long   len;    // Length of the content
+} file_map_t;
+
+/* read the file and fstat what was read into statbuf, returns 0 or -1 (errno set) */
+int file_map_open(file_map_t *map, const char *filename, struct stat *statbuf);
+
+/* free the content */
+void file_map_close(file_map_t *map);
+
+#endif
@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "handle_table.h"
+
+#define HANDLE_SLOT(handle)         ((uint32_t)(handle))
+#define HANDLE_GENERATION(handle)   ((uint32_t)((handle) >> 32))
+
+typedef struct {
+    uint32_t    generation; // Odd while the slot holds an object
+    uint32_t    next_free;  // Next free slot + 1 while the slot is free, 0 ends the list
+    void       *obj;
+} slot_t;
+
+struct handle_table {
+    pthread_rwlock_t    rw;         // Writers change slots, readers hold objects
+    slot_t             *slots;
+    uint32_t            size;       // Slots allocated
+    uint32_t            used;       // Slots ever handed out
+    uint32_t            free_head;  // First free slot + 1, 0 if none
+    int                 count;      // Valid handles
+};
+
+/* creates an empty table, NULL on error */
+handle_table_t* handle_table_create(void) {
+    handle_table_t *table = calloc(1, sizeof(handle_table_t));
+    if(!table)
+        return NULL;
+    pthread_rwlock_init(&table->rw, NULL);
+    return table;
+}
+
+/* returns a new handle for obj, 0 on error (no handle is 0) */
+handle_t handle_alloc(handle_table_t *table, void *obj) {
+    uint32_t index;
+
+    pthread_rwlock_wrlock(&table->rw);
+    if(table->free_head) {
+        index = table->free_head - 1;
+        table->free_head = table->slots[index].next_free;
+    } else {
+        if(table->used == table->size) {
+            uint32_t size = table->size ? table->size * 2 : 64;
+            slot_t *slots = size > table->size ? realloc(table->slots, size * sizeof(slot_t)) : NULL;
+            if(!slots) {
+                pthread_rwlock_unlock(&table->rw);
+                return 0;
+            }
+            table->slots = slots;
+            table->size = size;
+        }
+        index = table->used++;
+        table->slots[index].generation = 0;
+    }
+    slot_t *slot = &table->slots[index];
+    slot->generation++;
+    slot->next_free = 0;
+    slot->obj = obj;
+    table->count++;
+    handle_t handle = (handle_t)slot->generation << 32 | index;
+    pthread_rwlock_unlock(&table->rw);
+    return handle;
+}
+
+/* slot of a valid handle or NULL, table locked */
+static slot_t* find(handle_table_t *table, handle_t handle) {
+    uint32_t index = HANDLE_SLOT(handle);
+    if(index >= table->used)
+        return NULL;
+    slot_t *slot = &table->slots[index];
+    return slot->generation == HANDLE_GENERATION(handle) && (slot->generation & 1) ? slot : NULL;
+}
+
+/* invalidates the handle; waits until nobody holds it locked */
+void handle_release(handle_table_t *table, handle_t handle) {
+    pthread_rwlock_wrlock(&table->rw);
+    slot_t *slot = find(table, handle);
+    if(slot) {
+        slot->generation++;
+        slot->obj = NULL;
+        slot->next_free = table->free_head;
+        table->free_head = HANDLE_SLOT(handle) + 1;
+        table->count--;
+    }
+    pthread_rwlock_unlock(&table->rw);
+}
+
+/* returns the object of the handle, NULL if the handle is stale; */
+/* unless NULL the object stays valid until handle_unlock */
+void* handle_lock(handle_table_t *table, handle_t handle) {
+    pthread_rwlock_rdlock(&table->rw);
+    slot_t *slot = find(table, handle);
+    if(!slot) {
+        pthread_rwlock_unlock(&table->rw);
+        return NULL;
+    }
+    return slot->obj;
+}
+
+/* ends the use of an object returned by handle_lock */
+void handle_unlock(handle_table_t *table) {
+    pthread_rwlock_unlock(&table->rw);
+}
+
+/* number of valid handles */
+int handle_count(handle_table_t *table) {
+    pthread_rwlock_rdlock(&table->rw);
+    int count = table->count;
+    pthread_rwlock_unlock(&table->rw);
+    return count;
+}
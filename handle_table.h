@@ -0,0 +1,38 @@
+
+/*
+   Table of global handles.
+   A handle packs the index of a slot in the table (low 32 bits) and the
+   generation of the slot (high 32 bits). The generation is incremented
+   whenever the slot is released, so a stale handle never finds the next
+   object in the slot. Lookups are a bounds check and a compare.
+*/
+
+#ifndef _HANDLE_TABLE_H_
+#define _HANDLE_TABLE_H_
+
+#include <stdint.h>
+
+typedef uint64_t handle_t;
+
+typedef struct handle_table handle_table_t;
+
+/* creates an empty table, NULL on error */
+handle_table_t* handle_table_create(void);
+
+/* returns a new handle for obj, 0 on error (no handle is 0) */
+handle_t handle_alloc(handle_table_t *table, void *obj);
+
+/* invalidates the handle; waits until nobody holds it locked */
+void handle_release(handle_table_t *table, handle_t handle);
+
+/* returns the object of the handle, NULL if the handle is stale; */
+/* unless NULL the object stays valid until handle_unlock */
+void* handle_lock(handle_table_t *table, handle_t handle);
+
+/* ends the use of an object returned by handle_lock */
+void handle_unlock(handle_table_t *table);
+
+/* number of valid handles */
+int handle_count(handle_table_t *table);
+
+#endif
@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include "heap.h"
+
+// @return 1 if a has to be above b
+static int heap_less(heap_node_t *a, heap_node_t *b) {
+    if(a->key != b->key)
+        return a->key < b->key;
+    return a->seq < b->seq;
+}
+
+static void heap_set(heap_t *heap, int i, heap_node_t *node) {
+    heap->nodes[i] = node;
+    node->index = i;
+}
+
+static void heap_sift_up(heap_t *heap, int i) {
+    heap_node_t *node = heap->nodes[i];
+    while(i > 0) {
+        int parent = (i - 1) / 2;
+        if(!heap_less(node, heap->nodes[parent]))
+            break;
+        heap_set(heap, i, heap->nodes[parent]);
+        i = parent;
+    }
+    heap_set(heap, i, node);
+}
+
+static void heap_sift_down(heap_t *heap, int i) {
+    heap_node_t *node = heap->nodes[i];
+    while(1) {
+        int child = 2 * i + 1;
+        if(child >= heap->size)
+            break;
+        if(child + 1 < heap->size && heap_less(heap->nodes[child + 1], heap->nodes[child]))
+            child++;
+        if(!heap_less(heap->nodes[child], node))
+            break;
+        heap_set(heap, i, heap->nodes[child]);
+        i = child;
+    }
+    heap_set(heap, i, node);
+}
+
+/* initialize an empty heap */
+void heap_init(heap_t *heap) {
+    heap->nodes = NULL;
+    heap->size = 0;
+    heap->capacity = 0;
+    heap->seq = 0;
+}
+
+/* free the heap's array (not the nodes) */
+void heap_destroy(heap_t *heap) {
+    free(heap->nodes);
+    heap_init(heap);
+}
+
+/* initialize a node that is not in any heap */
+void heap_node_init(heap_node_t *node) {
+    node->key = 0;
+    node->seq = 0;
+    node->index = -1;
+}
+
+/* insert node with the given key, returns 0 or -1 (out of memory) */
+int heap_push(heap_t *heap, heap_node_t *node, long long key) {
+    if(heap->size == heap->capacity) {
+        int capacity = heap->capacity ? 2 * heap->capacity : 16;
+        heap_node_t **nodes = realloc(heap->nodes, capacity * sizeof(heap_node_t*));
+        if(!nodes)
+            return -1;
+        heap->nodes = nodes;
+        heap->capacity = capacity;
+    }
+    node->key = key;
+    node->seq = heap->seq++;
+    heap_set(heap, heap->size++, node);
+    heap_sift_up(heap, node->index);
+    return 0;
+}
+
+/* returns the node with the smallest key or NULL */
+heap_node_t* heap_top(heap_t *heap) {
+    return heap->size ? heap->nodes[0] : NULL;
+}
+
+/* removes and returns the node with the smallest key or NULL */
+heap_node_t* heap_pop(heap_t *heap) {
+    heap_node_t *top = heap_top(heap);
+    if(top)
+        heap_remove(heap, top);
+    return top;
+}
+
+/* removes the given node from the heap */
+void heap_remove(heap_t *heap, heap_node_t *node) {
+    int i = node->index;
+    if(i < 0 || i >= heap->size || heap->nodes[i] != node)
+        return;
+    heap->size--;
+    if(i != heap->size) {
+        heap_node_t *last = heap->nodes[heap->size];
+        heap_set(heap, i, last);
+        heap_sift_up(heap, i);
+        heap_sift_down(heap, last->index);
+    }
+    node->index = -1;
+}
+
+/* changes the key of a node in the heap, keeps its insertion order */
+void heap_update(heap_t *heap, heap_node_t *node, long long key) {
+    node->key = key;
+    if(node->index < 0)
+        return;
+    heap_sift_up(heap, node->index);
+    heap_sift_down(heap, node->index);
+}
+
+/* tests whether a heap is empty */
+int heap_empty(heap_t *heap) {
+    return heap->size == 0;
+}
@@ -0,0 +1,53 @@
+#ifndef _HEAP_H_
+#define _HEAP_H_
+#include <stddef.h>
+
+/*
+   Indexed binary min-heap.
+   Nodes are embedded into the managed structs (like list_head_t)
+   and remember their position, so they can be updated or removed
+   in O(log n).
+*/
+typedef struct heap_node {
+    long long           key;    // Ordering key, smallest first
+    unsigned long long  seq;    // Insertion order, breaks ties (FIFO)
+    int                 index;  // Position in the heap, -1 if not in a heap
+} heap_node_t;
+
+typedef struct {
+    heap_node_t**       nodes;
+    int                 size;
+    int                 capacity;
+    unsigned long long  seq;
+} heap_t;
+
+/* initialize an empty heap */
+void heap_init(heap_t *heap);
+
+/* free the heap's array (not the nodes) */
+void heap_destroy(heap_t *heap);
+
+/* initialize a node that is not in any heap */
+void heap_node_init(heap_node_t *node);
+
+/* insert node with the given key, returns 0 or -1 (out of memory) */
+int heap_push(heap_t *heap, heap_node_t *node, long long key);
+
+/* returns the node with the smallest key or NULL */
+heap_node_t* heap_top(heap_t *heap);
+
+/* removes and returns the node with the smallest key or NULL */
+heap_node_t* heap_pop(heap_t *heap);
+
+/* removes the given node from the heap */
+void heap_remove(heap_t *heap, heap_node_t *node);
+
+/* changes the key of a node in the heap, keeps its insertion order */
+void heap_update(heap_t *heap, heap_node_t *node, long long key);
+
+/* tests whether a heap is empty */
+int heap_empty(heap_t *heap);
+
+/* get the struct for this node */
+#define heap_entry(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+#endif
@@ -0,0 +1,489 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "io_engine.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+/* Operations per ring and size of its registered buffer */
+#define RING_ENTRIES    64
+#define RING_ARENA      (64 * 1024)
+
+/* File descriptors whose failed queued writes are remembered, writes to higher ones are not queued */
+#define IO_ERROR_FDS    65536
+
+/* Data of queued writes to a descriptor that failed, until its writer takes it */
+typedef struct {
+    int         failed;     // 1 if there is some
+    char*       data;
+    size_t      len;
+} lost_writes_t;
+
+static int use_uring = 0;
+static io_engine_stats_t engine_stats = { "sync", 0, 0, 0 };
+static lost_writes_t lost_writes[IO_ERROR_FDS];
+static pthread_mutex_t lost_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void count(unsigned long long *counter, unsigned long long n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+/* write() until everything is written, len or -1 */
+static ssize_t write_all(int fd, const char *buf, size_t len) {
+    size_t done = 0;
+    while(done < len) {
+        ssize_t res = write(fd, buf + done, len - done);
+        if(res == -1 && errno == EINTR)
+            continue;
+        if(res <= 0)
+            return -1;
+        done += res;
+    }
+    return len;
+}
+
+#ifdef HAVE_IO_URING
+
+/* keeps the data of a failed queued write for its writer */
+static void keep_lost(int fd, const char *buf, size_t len) {
+    pthread_mutex_lock(&lost_mutex);
+    lost_writes_t *lost = &lost_writes[fd];
+    char *data = realloc(lost->data, lost->len + len);
+    if(data) {
+        memcpy(data + lost->len, buf, len);
+        lost->data = data;
+        lost->len += len;
+    }
+    __atomic_store_n(&lost->failed, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lost_mutex);
+}
+
+/* A queued operation */
+typedef struct {
+    int         fd;
+    int         read;       // 1: read, 0: write
+    char*       buf;        // Inside the arena
+    unsigned    len;
+    int         deferred;   // 1: queued by io_write, its writer learns about a failure later
+    struct io_uring_sqe *sqe;
+    int         res;        // Result once completed
+} ring_op_t;
+
+/* The io_uring of a thread */
+typedef struct {
+    int         fd;
+    void*       sq_ptr;
+    size_t      sq_size;
+    void*       cq_ptr;
+    size_t      cq_size;
+    struct io_uring_sqe *sqes;
+    size_t      sqes_size;
+    unsigned   *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned   *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned    sq_entries;
+    char*       arena;      // Buffer for the data of queued operations
+    size_t      arena_used;
+    int         fixed;      // 1: arena is registered with the ring
+    ring_op_t   ops[RING_ENTRIES];
+    unsigned    queued;     // Operations prepared, not yet submitted
+} ring_t;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned submit, unsigned complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static void ring_destroy(ring_t *ring) {
+    if(ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if(ring->sq_ptr)
+        munmap(ring->sq_ptr, ring->sq_size);
+    if(ring->arena)
+        munmap(ring->arena, RING_ARENA);
+    close(ring->fd);
+    free(ring);
+}
+
+/* sets up a ring with its arena, NULL on error (errno set) */
+static ring_t* ring_create(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = sys_io_uring_setup(RING_ENTRIES, &params);
+    if(fd == -1)
+        return NULL;
+
+    ring_t *ring = calloc(1, sizeof(ring_t));
+    ring->fd = fd;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        goto error;
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = NULL;
+            goto error;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto error;
+    }
+
+    char *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    ring->arena = mmap(NULL, RING_ARENA, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->arena == MAP_FAILED) {
+        ring->arena = NULL;
+        goto error;
+    }
+    // Registered, the kernel does not have to map the pages for every operation
+    struct iovec iov = { ring->arena, RING_ARENA };
+    ring->fixed = sys_io_uring_register(fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    return ring;
+
+error:
+    ring_destroy(ring);
+    return NULL;
+}
+
+/* 1 if the kernel supports the operations used, 0 otherwise */
+static int ring_probe(ring_t *ring) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int ok = 0;
+    if(sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        int ops[] = { IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED };
+        ok = 1;
+        for(int i = 0; i < 4; i++) {
+            if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+                ok = 0;
+        }
+    }
+    free(probe);
+    return ok;
+}
+
+/* prepares an operation on data already in the arena */
+static ring_op_t* ring_prep(ring_t *ring, int fd, int read, char *buf, unsigned len) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    ring_op_t *op = &ring->ops[ring->queued];
+
+    memset(sqe, 0, sizeof(*sqe));
+    if(ring->fixed) {
+        sqe->opcode = read ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->buf_index = 0;
+    } else {
+        sqe->opcode = read ? IORING_OP_READ : IORING_OP_WRITE;
+    }
+    sqe->fd = fd;
+    sqe->off = (__u64)-1;   // Current file position
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->user_data = ring->queued;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    op->fd = fd;
+    op->read = read;
+    op->buf = buf;
+    op->len = len;
+    op->deferred = 0;
+    op->sqe = sqe;
+    op->res = 0;
+    ring->queued++;
+    return op;
+}
+
+/* submits all queued operations and waits for their completion */
+static void ring_submit(ring_t *ring) {
+    unsigned queued = ring->queued;
+    unsigned submitted = 0, completed = 0;
+
+    if(!queued)
+        return;
+    while(completed < queued) {
+        unsigned head = *ring->cq_head;
+        if(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            ring->ops[cqe->user_data].res = cqe->res;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            completed++;
+            continue;
+        }
+        int res = sys_io_uring_enter(ring->fd, queued - submitted, 1, IORING_ENTER_GETEVENTS);
+        if(res == -1) {
+            if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            perror("io_uring_enter");
+            abort();
+        }
+        if(res > 0) {
+            submitted += res;
+            count(&engine_stats.submissions, 1);
+            count(&engine_stats.operations, res);
+        }
+    }
+
+    // Writes the kernel did not finish are completed the plain way
+    for(unsigned i = 0; i < queued; i++) {
+        ring_op_t *op = &ring->ops[i];
+        if(op->read || op->res == (int)op->len || op->res == -ECANCELED)
+            continue;
+        if(op->res < 0 || write_all(op->fd, op->buf + op->res, op->len - op->res) == -1) {
+            count(&engine_stats.errors, 1);
+            // The writer learns about it with its next write or flush,
+            // whatever was not written for sure is kept for it
+            if(op->deferred)
+                keep_lost(op->fd, op->buf + (op->res > 0 ? op->res : 0), op->len - (op->res > 0 ? op->res : 0));
+            op->res = -(op->res < 0 ? -op->res : errno);
+        } else {
+            op->res = op->len;
+        }
+    }
+    ring->queued = 0;
+    ring->arena_used = 0;
+}
+
+static void ring_release(void *arg) {
+    ring_t *ring = arg;
+    if(ring) {
+        ring_submit(ring);
+        ring_destroy(ring);
+    }
+}
+
+static void ring_key_create(void) {
+    pthread_key_create(&ring_key, ring_release);
+}
+
+/* the ring of the calling thread, created on first use; NULL: use system calls */
+static ring_t* thread_ring(void) {
+    if(!use_uring)
+        return NULL;
+    pthread_once(&ring_key_once, ring_key_create);
+    ring_t *ring = pthread_getspecific(ring_key);
+    if(!ring) {
+        ring = ring_create();
+        if(!ring)
+            return NULL;
+        pthread_setspecific(ring_key, ring);
+    }
+    return ring;
+}
+
+#endif
+
+/* selects "sync" or "uring" (falls back to sync if unavailable), 0 or -1 (unknown engine) */
+int io_engine_select(const char *name) {
+    if(!strcmp(name, "sync")) {
+        use_uring = 0;
+        engine_stats.name = "sync";
+        return 0;
+    }
+    if(strcmp(name, "uring"))
+        return -1;
+#ifdef HAVE_IO_URING
+    ring_t *ring = ring_create();
+    if(ring && ring_probe(ring)) {
+        use_uring = 1;
+        engine_stats.name = ring->fixed ? "uring" : "uring (unregistered buffers)";
+    } else {
+        fprintf(stderr, "io_uring is not available (%s), using plain system calls\n",
+                ring ? "operations not supported" : strerror(errno));
+    }
+    if(ring)
+        ring_destroy(ring);
+#else
+    fprintf(stderr, "io_uring is not available on this system, using plain system calls\n");
+#endif
+    return 0;
+}
+
+/* like write(), but the data may only be queued until the next io_flush */
+ssize_t io_write(int fd, const void *buf, size_t len) {
+#ifdef HAVE_IO_URING
+    ring_t *ring = thread_ring();
+    if(ring && fd < IO_ERROR_FDS) {
+        if(len > RING_ARENA / 2) {
+            // Too large to queue, but it must not overtake what is queued
+            ring_submit(ring);
+            return write_all(fd, buf, len);
+        }
+        if(ring->queued) {
+            // Continues the last queued write: just make that one longer
+            ring_op_t *last = &ring->ops[ring->queued - 1];
+            if(!last->read && last->fd == fd && last->buf + last->len == ring->arena + ring->arena_used
+               && ring->arena_used + len <= RING_ARENA) {
+                memcpy(ring->arena + ring->arena_used, buf, len);
+                ring->arena_used += len;
+                last->len += len;
+                last->sqe->len = last->len;
+                return len;
+            }
+        }
+        // A second write to the file in the same batch could overtake the first one
+        for(unsigned i = 0; i < ring->queued; i++) {
+            if(ring->ops[i].fd == fd) {
+                ring_submit(ring);
+                break;
+            }
+        }
+        if(ring->queued == RING_ENTRIES || ring->queued == ring->sq_entries || ring->arena_used + len > RING_ARENA)
+            ring_submit(ring);
+        memcpy(ring->arena + ring->arena_used, buf, len);
+        ring_prep(ring, fd, 0, ring->arena + ring->arena_used, len)->deferred = 1;
+        ring->arena_used += len;
+        return len;
+    }
+#endif
+    count(&engine_stats.submissions, 1);
+    count(&engine_stats.operations, 1);
+    ssize_t res = write(fd, buf, len);
+    if(res == -1)
+        count(&engine_stats.errors, 1);
+    return res;
+}
+
+/* submits the writes queued by the calling thread and waits for them */
+void io_flush(void) {
+#ifdef HAVE_IO_URING
+    ring_t *ring = thread_ring();
+    if(ring)
+        ring_submit(ring);
+#endif
+}
+
+/* 1 if a write to fd that io_write queued has failed (cheap), 0 otherwise */
+int io_write_failed(int fd) {
+    if(fd < 0 || fd >= IO_ERROR_FDS)
+        return 0;
+    return __atomic_load_n(&lost_writes[fd].failed, __ATOMIC_ACQUIRE);
+}
+
+/* takes the data of the failed queued writes to fd (to be freed), NULL if none */
+char* io_write_lost(int fd, size_t *len) {
+    *len = 0;
+    if(!io_write_failed(fd))
+        return NULL;
+    pthread_mutex_lock(&lost_mutex);
+    lost_writes_t *lost = &lost_writes[fd];
+    char *data = lost->data;
+    *len = lost->len;
+    lost->data = NULL;
+    lost->len = 0;
+    lost->failed = 0;
+    pthread_mutex_unlock(&lost_mutex);
+    // Even if its data could not be kept, the caller learns about the failure
+    return data ? data : malloc(1);
+}
+
+/* writes reply_len bytes of reply, then reads up to size bytes (like read()) */
+ssize_t io_write_read(int fd, const void *reply, size_t reply_len, void *buf, size_t size) {
+#ifdef HAVE_IO_URING
+    ring_t *ring = thread_ring();
+    if(ring && reply_len + size <= RING_ARENA) {
+        ring_submit(ring);
+        ring_op_t *write_op = NULL, *read_op = NULL;
+        if(reply_len) {
+            memcpy(ring->arena, reply, reply_len);
+            write_op = ring_prep(ring, fd, 0, ring->arena, reply_len);
+            // The read only starts once the reply is out
+            if(size)
+                write_op->sqe->flags |= IOSQE_IO_LINK;
+        }
+        if(size)
+            read_op = ring_prep(ring, fd, 1, ring->arena + reply_len, size);
+        ring_submit(ring);
+
+        if(write_op && write_op->res < 0) {
+            errno = -write_op->res;
+            return -1;
+        }
+        if(!read_op)
+            return 0;
+        if(read_op->res == -ECANCELED) {
+            // The reply was written in two parts, the link broke
+            return read(fd, buf, size);
+        }
+        if(read_op->res < 0) {
+            count(&engine_stats.errors, 1);
+            errno = -read_op->res;
+            return -1;
+        }
+        memcpy(buf, ring->arena + reply_len, read_op->res);
+        return read_op->res;
+    }
+#endif
+    if(reply_len) {
+        count(&engine_stats.submissions, 1);
+        count(&engine_stats.operations, 1);
+        if(write_all(fd, reply, reply_len) == -1) {
+            count(&engine_stats.errors, 1);
+            return -1;
+        }
+    }
+    if(!size)
+        return 0;
+    count(&engine_stats.submissions, 1);
+    count(&engine_stats.operations, 1);
+    return read(fd, buf, size);
+}
+
+/* current statistics */
+void io_engine_stats(io_engine_stats_t *stats) {
+    stats->name = engine_stats.name;
+    stats->submissions = __atomic_load_n(&engine_stats.submissions, __ATOMIC_RELAXED);
+    stats->operations = __atomic_load_n(&engine_stats.operations, __ATOMIC_RELAXED);
+    stats->errors = __atomic_load_n(&engine_stats.errors, __ATOMIC_RELAXED);
+}
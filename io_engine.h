@@ -0,0 +1,47 @@
+
+/*
+   How printer output and client replies reach the kernel.
+   "sync" uses one write() or read() per call. "uring" queues writes
+   in a per-thread io_uring with a registered buffer and submits them
+   in batches: when the thread is about to sleep (io_flush), when the
+   ring is full, or before a second write to the same file, so that
+   writes to one file stay in order. A client's reply and its next read
+   go into one submission. Without io_uring the engine falls back to sync.
+   The data of a queued write that fails is kept for its file
+   descriptor until the writer takes it with io_write_lost.
+*/
+
+#ifndef _IO_ENGINE_H_
+#define _IO_ENGINE_H_
+
+#include <sys/types.h>
+
+typedef struct {
+    const char*         name;           // Engine in use
+    unsigned long long  submissions;    // System calls that submitted operations
+    unsigned long long  operations;     // Reads and writes submitted
+    unsigned long long  errors;         // Failed operations
+} io_engine_stats_t;
+
+/* selects "sync" or "uring" (falls back to sync if unavailable), 0 or -1 (unknown engine) */
+int io_engine_select(const char *name);
+
+/* like write(), but the data may only be queued until the next io_flush */
+ssize_t io_write(int fd, const void *buf, size_t len);
+
+/* submits the writes queued by the calling thread and waits for them */
+void io_flush(void);
+
+/* 1 if a write to fd that io_write queued has failed (cheap), 0 otherwise */
+int io_write_failed(int fd);
+
+/* takes the data of the failed queued writes to fd (to be freed), NULL if none */
+char* io_write_lost(int fd, size_t *len);
+
+/* writes reply_len bytes of reply, then reads up to size bytes (like read()) */
+ssize_t io_write_read(int fd, const void *reply, size_t reply_len, void *buf, size_t size);
+
+/* current statistics */
+void io_engine_stats(io_engine_stats_t *stats);
+
+#endif
@@ -0,0 +1,40 @@
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "page_index.h"
+
+/* initialize an empty index */
+void page_index_init(page_index_t *index) {
+    index->lines = 0;
+    index->size = 0;
+}
+
+/* index a buffer */
+void page_index_build(page_index_t *index, const char *buf, long long len) {
+    long long pos = 0;
+
+    page_index_init(index);
+    index->size = len;
+
+#ifdef __SSE2__
+    // Compare 16 bytes at once, count the newlines found
+    const __m128i newline = _mm_set1_epi8('\n');
+    for(; pos + 16 <= len; pos += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(buf + pos));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+        index->lines += __builtin_popcount(mask);
+    }
+#endif
+    // The rest (or everything without SSE2): let memchr do the scanning
+    while(pos < len) {
+        const char *nl = memchr(buf + pos, '\n', len - pos);
+        if(!nl)
+            break;
+        index->lines++;
+        pos = nl - buf + 1;
+    }
+    // Last line without newline
+    if(len > 0 && buf[len - 1] != '\n')
+        index->lines++;
+}
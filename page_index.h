@@ -0,0 +1,22 @@
+
+/*
+   Page index of a file: how many lines it has.
+   Built once when a job is submitted, so the page count (and price)
+   is known before printing on the page geometry of any printer class.
+*/
+
+#ifndef _PAGE_INDEX_H_
+#define _PAGE_INDEX_H_
+
+typedef struct {
+    long long   lines;          // Number of lines (the last one may lack its newline)
+    long long   size;           // Size of the file in bytes
+} page_index_t;
+
+/* initialize an empty index */
+void page_index_init(page_index_t *index);
+
+/* index a buffer */
+void page_index_build(page_index_t *index, const char *buf, long long len);
+
+#endif
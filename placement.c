@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "placement.h"
+#include "printer_management.h"
+
+#define MAX_CPUS        1024
+#define MAX_NODES       64
+#define ARENA_SIZE      (64 * 1024)
+#define CACHE_LINE      64
+#define MPOL_PREFERRED  1
+
+typedef struct {
+    int             cpus[MAX_CPUS]; // CPUs of the set in the order given
+    int             count;          // 0: no policy
+    char            spec[64];       // The set as given
+} cpu_list_t;
+
+typedef struct {
+    char           *next;           // Free memory of the current chunk
+    size_t          left;           // Bytes left in it
+    size_t          allocated;      // Bytes handed out
+} arena_t;
+
+static const char *role_names[PLACE_ROLES] = { "accept", "clients", "spoolers" };
+static cpu_list_t roles[PLACE_ROLES];
+#ifdef __linux__
+static cpu_set_t initial;           // CPUs of the process before any binding
+#endif
+static int configured = 0;          // Some role has a policy
+static arena_t arenas[MAX_NODES];
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* parses a CPU list like "0-3,8" into list, 0 or -1 */
+static int parse_cpus(const char *spec, cpu_list_t *list) {
+    const char *p = spec;
+    list->count = 0;
+    while(*p) {
+        char *end;
+        long from = strtol(p, &end, 10), to;
+        if(end == p || from < 0 || from >= MAX_CPUS)
+            return -1;
+        to = from;
+        p = end;
+        if(*p == '-') {
+            to = strtol(p + 1, &end, 10);
+            if(end == p + 1 || to < from || to >= MAX_CPUS)
+                return -1;
+            p = end;
+        }
+        for(long cpu = from; cpu <= to && list->count < MAX_CPUS; cpu++)
+            list->cpus[list->count++] = (int)cpu;
+        if(*p == ',')
+            p++;
+        else if(*p)
+            return -1;
+    }
+    snprintf(list->spec, sizeof(list->spec), "%s", spec);
+    return list->count ? 0 : -1;
+}
+
+/* parses "role=cpus/role=cpus..." with the roles accept, clients and */
+/* spoolers and cpus like "0-3,8"; 0 or -1 (malformed or not supported) */
+int placement_parse(const char *spec) {
+#ifndef __linux__
+    (void)spec;
+    return -1;
+#else
+    if(!configured && sched_getaffinity(0, sizeof(initial), &initial) == -1)
+        return -1;
+    configured = 1;
+
+    char *copy = strdup(spec);
+    char *save = NULL;
+    int error = 0;
+    for(char *item = strtok_r(copy, "/", &save); item && !error; item = strtok_r(NULL, "/", &save)) {
+        char *cpus = strchr(item, '=');
+        int role;
+        if(!cpus) {
+            error = 1;
+            break;
+        }
+        *cpus++ = 0;
+        for(role = 0; role < PLACE_ROLES && strcmp(item, role_names[role]); role++)
+            ;
+        if(role == PLACE_ROLES || parse_cpus(cpus, &roles[role]) == -1)
+            error = 1;
+    }
+    free(copy);
+    return error ? -1 : 0;
+#endif
+}
+
+/* binds a thread to the CPUs of its role, a spooler to the index-th */
+/* CPU of the set; returns the CPU (-1 for a whole set or no policy) */
+/* A role without policy gets the CPUs the process started with. */
+int placement_bind(pthread_t thread, place_role_e role, int index) {
+#ifdef __linux__
+    cpu_list_t *list = &roles[role];
+    cpu_set_t set;
+    int cpu = -1;
+
+    if(!configured)
+        return -1;
+    CPU_ZERO(&set);
+    if(!list->count) {
+        // Do not inherit the set of the thread that created this one
+        set = initial;
+    } else if(role == PLACE_SPOOLERS) {
+        cpu = list->cpus[index % list->count];
+        CPU_SET(cpu, &set);
+    } else {
+        for(int i = 0; i < list->count; i++)
+            CPU_SET(list->cpus[i], &set);
+    }
+    int error = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if(error) {
+        fprintf(stderr, "Could not bind %s thread: %s\n", role_names[role], strerror(error));
+        return -1;
+    }
+    return cpu;
+#else
+    (void)thread; (void)role; (void)index;
+    return -1;
+#endif
+}
+
+/* NUMA node of a CPU from sysfs, -1 if unknown */
+static int cpu_node(int cpu) {
+    char path[64];
+    struct dirent *entry;
+    int node = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if(!dir)
+        return -1;
+    while(node < 0 && (entry = readdir(dir)) != NULL) {
+        if(!strncmp(entry->d_name, "node", 4) && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+            node = atoi(entry->d_name + 4);
+    }
+    closedir(dir);
+    return node;
+}
+
+/* NUMA node of the index-th CPU of a role, -1 if unknown or no policy */
+int placement_node(place_role_e role, int index) {
+    cpu_list_t *list = &roles[role];
+    if(!list->count)
+        return -1;
+    return cpu_node(list->cpus[index % list->count]);
+}
+
+/* zeroed, cache line aligned memory from an arena on the given node */
+/* (or plain memory if node is -1), never freed; NULL on error */
+void* placement_alloc(size_t size, int node) {
+    if(node < 0 || node >= MAX_NODES || size > ARENA_SIZE)
+        return calloc(1, size);
+
+    size = (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    pthread_mutex_lock(&arena_mutex);
+    arena_t *arena = &arenas[node];
+    if(arena->left < size) {
+        void *chunk = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(chunk == MAP_FAILED) {
+            pthread_mutex_unlock(&arena_mutex);
+            return NULL;
+        }
+#ifdef SYS_mbind
+        // Pages are placed on first touch: prefer the node from now on
+        unsigned long mask = 1UL << node;
+        if(syscall(SYS_mbind, chunk, ARENA_SIZE, MPOL_PREFERRED, &mask, MAX_NODES + 1, 0) == -1)
+            perror("mbind");
+#endif
+        arena->next = chunk;
+        arena->left = ARENA_SIZE;
+    }
+    void *mem = arena->next;
+    arena->next += size;
+    arena->left -= size;
+    arena->allocated += size;
+    pthread_mutex_unlock(&arena_mutex);
+    return mem;
+}
+
+/* appends a description of the policy to buf (at most len bytes) */
+void placement_describe(char *buf, size_t len) {
+    for(int role = 0; role < PLACE_ROLES; role++) {
+        cpu_list_t *list = &roles[role];
+        string_appendf(buf, len, role ? ", " : "");
+        if(!list->count) {
+            string_appendf(buf, len, "%s floating", role_names[role]);
+            continue;
+        }
+        string_appendf(buf, len, "%s on cpus %s (node", role_names[role], list->spec);
+        int last = -2;
+        for(int i = 0; i < list->count; i++) {
+            int node = cpu_node(list->cpus[i]);
+            if(node != last)
+                string_appendf(buf, len, last == -2 ? " %d" : "+%d", node);
+            last = node;
+        }
+        string_appendf(buf, len, ")");
+    }
+    pthread_mutex_lock(&arena_mutex);
+    for(int node = 0; node < MAX_NODES; node++) {
+        if(arenas[node].allocated)
+            string_appendf(buf, len, ", %zu bytes of printers on node %d", arenas[node].allocated, node);
+    }
+    pthread_mutex_unlock(&arena_mutex);
+}
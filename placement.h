@@ -0,0 +1,43 @@
+
+/*
+   Placement of the server's threads on CPUs and of printer state on
+   NUMA nodes. Every role has a CPU set: the acceptor and the client
+   workers may run on any CPU of their set, spoolers (timer wheel
+   threads) are pinned to one CPU of theirs each, round robin. Memory
+   for a spooler's printers comes from an arena bound to that CPU's node.
+   Without a policy for a role its threads float freely as before.
+*/
+
+#ifndef _PLACEMENT_H_
+#define _PLACEMENT_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+typedef enum {
+    PLACE_ACCEPT,       // The thread accepting connections
+    PLACE_CLIENTS,      // Client workers
+    PLACE_SPOOLERS,     // Timer wheel threads driving the printers
+    PLACE_ROLES
+} place_role_e;
+
+/* parses "role=cpus/role=cpus..." with the roles accept, clients and */
+/* spoolers and cpus like "0-3,8"; 0 or -1 (malformed or not supported) */
+int placement_parse(const char *spec);
+
+/* binds a thread to the CPUs of its role, a spooler to the index-th */
+/* CPU of the set; returns the CPU (-1 for a whole set or no policy) */
+/* A role without policy gets the CPUs the process started with. */
+int placement_bind(pthread_t thread, place_role_e role, int index);
+
+/* NUMA node of the index-th CPU of a role, -1 if unknown or no policy */
+int placement_node(place_role_e role, int index);
+
+/* zeroed, cache line aligned memory from an arena on the given node */
+/* (or plain memory if node is -1), never freed; NULL on error */
+void* placement_alloc(size_t size, int node);
+
+/* appends a description of the policy to buf (at most len bytes) */
+void placement_describe(char *buf, size_t len);
+
+#endif
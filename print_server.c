@@ -3,10 +3,26 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
 #include "dbllinklist.h"
+#include "heap.h"
+#include "io_engine.h"
+#include "cancel_token.h"
+#include "device_cache.h"
+#include "file_cache.h"
+#include "handle_table.h"
 #include "makeargv.h"
+#include "placement.h"
+#include "printer_config.h"
+#include "printer_discovery.h"
 #include "printer_management.h"
+#include "spool_journal.h"
+#include "timer_wheel.h"
 #include "UICI/restart.h"
 #include "UICI/uici.h"
 
@@ -34,16 +50,41 @@ typedef struct {
 } connection_t;
 
 /* Represents a client connected to the server */
-typedef struct {
+typedef struct client {
     list_head_t     list_elem;  // Pointers to next and previos client (-> list clients)
     list_elem_t     jobs;       // Anchor to the list of jobs started by this client
     pthread_rwlock_t joblist_rw; // RW lock for manipulating the joblist
     int             job_counter;// For assigning new job ids
     int             id;         // Id of the client
-    connection_t*   connection; // Connection to the client
+    uint64_t        token;      // Secret that reattaches the session after a reconnect
+    int             admin;      // 1 once "admin" was given the admin token: may configure the server
+    connection_t*   connection; // Connection to the client, NULL while the session is detached
+    struct client*  attach;     // Detached session the connection takes over after the current command
     int             quit;       // quit != 0 -> close connection
+    int             queued_jobs;// Admitted jobs that are not over yet (guarded by group_mutex)
+    pthread_mutex_t done_mutex; // Mutex for the conditional
+    pthread_cond_t  done_cond;  // Conditional to broadcast when one of the client's jobs is over
+    struct job_record* history; // Ring of finished jobs not invoiced yet, NULL until the first one
+    int             history_next; // Slot of the ring the next finished job goes to
+    pthread_mutex_t ledger_mutex; // Guards the ledger
+    list_head_t     ledger;     // Charges per printer (-> ledger_entry_t)
+    long long       billed_pages; // Pages charged on all printers
+    long long       billed_cents; // Their price
+    pthread_mutex_t con_mutex;  // Guards the connection against its timeout
+    wheel_timer_t   timer;      // Idle or write stall timeout of the connection
+    long long       deadline_ms;// When the connection times out
+    const char*     waiting_for;// What the connection times out for ("idle", "write stall"),
+                                // "reattach" while detached, NULL if there is no timeout
 } client_t;
 
+/* Charges of a client on one printer */
+typedef struct {
+    list_head_t     list_elem;  // Pointers to next and previous entry of the client's ledger
+    int             printer_id; // The printer
+    long long       pages;      // Pages charged
+    long long       cents;      // Their price
+} ledger_entry_t;
+
 /* Enum for job stati */
 typedef enum {
     WAITING,
@@ -54,33 +95,123 @@ typedef enum {
     FILE_ERROR
 } status_e;
 
-/* Represents a printer */
+/*
+   A finished job, compacted until it is invoiced.
+   Lives in the fixed-size ring of its client, so jobs that are never
+   invoiced take no more room than the ring.
+*/
+typedef struct job_record {
+    int             id;         // Client job id, 0 for a free slot
+    int             sub_id;     // Target of a fan-out job, 0 for a single job
+    int             printer_id; // Printer of the job, 0 if there was none
+    status_e        status;     // Final status
+    int             pages;      // Pages printed
+    int             billed_pages; // Pages charged
+    int             cents;      // Price of the pages charged
+} job_record_t;
+
+/* Room for the separator and header of a page, or for a banner page */
+#define PAGE_HEAD_SIZE 1024
+
+/*
+   A page of a job, rendered and ready for the device: a head (separator,
+   job header or banner), the page's lines straight from the file's content
+   and a tail (page number), written one after the other.
+*/
 typedef struct {
+    const char*     seg[3];     // Head, body and tail, empty ones left out
+    size_t          seg_len[3];
+    int             segs;       // Segments of the page
+    int             cur;        // Segment being written
+    size_t          pos;        // Bytes of it written
+    int             count;      // Pages of the current job rendered in this run
+    long long       body_chars; // Characters of the file on the page
+    char            head[PAGE_HEAD_SIZE];
+    char            tail[64];
+} page_t;
+
+/* Represents a printer */
+typedef struct printer {
     list_head_t     list_elem;  // Pointers to next and previous printer (-> list printer_list)
     int             id;         // Id of the printer
-    list_elem_t     jobs;       // Anchor to the list of jobs assigned to this printer
-    int             fd;         // File descriptor to print to
-    pthread_rwlock_t joblist_rw; // RW lock for manipulating the joblist
-    pthread_mutex_t job_mutex;  // Mutex for the conditional
-    pthread_cond_t  job_cond;   // Conditional to broadcast when this printer goes to idle
+    list_head_t     flows;      // Anchor to the list of the clients' sub-queues (-> flow_t)
+    list_head_t     active;     // Round robin ring of flows with waiting jobs (-> flow_t.active_elem)
+    int             head_credited; // The flow at the front of the ring got its quantum for this turn
+    struct job*     current;    // Job that may print now, NULL if idle (guarded by joblist_rw)
+    device_t        device;     // Backend device to print to, opened when the printer starts a job
+    pthread_rwlock_t joblist_rw; // RW lock for manipulating the queue
+    pthread_mutex_t job_mutex;  // Serializes the printer's steps with cancellations
+    wheel_timer_t   timer;      // Time of the printer's next step
     status_e        status;     // Status of this printer
+    list_head_t     groups;     // Anchor to the list of group memberships (-> group_member_t)
+    long long       queued_chars; // Characters left to print in all queued jobs (guarded by group_mutex)
+    int             queued_jobs;  // Admitted jobs that are not over yet (guarded by group_mutex)
+    printer_config_t* config;   // Configuration the printer's class comes from (guarded by job_mutex)
+    const printer_class_t* class; // Class of the printer in config (guarded by job_mutex)
+    useconds_t      delay_us;   // Print delay of the class, for load estimates (guarded by group_mutex)
+    int             present;    // 1 while its device exists, 0 once discovery retired it (atomic)
+    page_t          page;       // Page of the current job on its way to the device (guarded by job_mutex)
 } printer_t;
 
+/*
+   A client's share of a printer: its waiting jobs and the
+   deficit round robin state. Guarded by the printer's joblist_rw.
+*/
+typedef struct {
+    list_head_t     list_elem;  // Pointers to next and previous flow of the printer
+    list_head_t     active_elem;// Pointers into the printer's active ring
+    int             client_id;  // Id of the client
+    heap_t          queue;      // Waiting jobs of the client, ordered by priority and age
+    long long       deficit;    // Pages the flow may print before it has to pass on
+    int             jobs_served;  // Jobs that got the printer
+    long long       wait_ms_total;// Summed up waiting time of these jobs
+    long long       wait_ms_max;  // Longest waiting time of these jobs
+} flow_t;
+
+/* Represents a group of printers jobs can be placed on */
+typedef struct {
+    list_head_t     list_elem;  // Pointers to next and previous group (-> list group_list)
+    char            name[MAX_CANON]; // Name of the group
+    heap_t          load_heap;  // Members ordered by estimated completion time
+    int             size;       // Number of printers in the group
+} group_t;
+
+/* Membership of a printer in a group */
+typedef struct {
+    list_head_t     list_elem;  // Pointers to next and previous membership of the printer
+    heap_node_t     heap_node;  // Node in the group's load heap
+    group_t*        group;      // The group
+    printer_t*      printer;    // The member
+} group_member_t;
+
 /*
    Represents a print job.
    Has no list_head_t member as job lists are managed via list_elem_t
    with pointers to jobs.
 */
-typedef struct {
+typedef struct job {
     list_elem_t     client_list_elem; // Job list element in the client's list
-    list_elem_t     printer_list_elem; // Job list element in the printer's list
+    heap_node_t     queue_node; // Node in the flow's queue
+    flow_t*         flow;       // Sub-queue of the client on the printer
+    int             priority;   // 0 (default) to 9 (most urgent)
+    int             est_pages;  // Page count, the job's cost for fair sharing
+    long long       enqueue_ms; // When the job was queued
     printer_t*      printer;    // Pointer to the printer that will have to execute this job
     client_t*       client;     // Pointer to the client that started this job
-    char*           filename;   // Name of the file to read from
-    FILE*           fd;         // File to read from
+    char*           filename;   // Name of the file to read from (the cache's copy if content is set)
+    file_content_t* content;    // Content and page index of the file, NULL if it could not be read
+    printer_config_t* config;   // Configuration when the job was created
+    const printer_class_t* class; // Class of its printer in config: page geometry and price of the job
     int             page_count; // How many pages have been printed
-    pthread_t       tid;        // Job worker thread id
+    int             billed_pages; // Pages charged to the client's ledger
+    ledger_entry_t* ledger;     // Ledger entry of the client for the job's printer, NULL until charged
+    long long       offset;     // Bytes of the file on the pages begun
+    long long       queued_chars; // Characters of this job still counted in the printer's load
+    cancel_token_t  cancel;     // Set by cancel, the printer stops the job at its next step
+    int             done;       // 1 once the job will not print anymore (guarded by the client's done_mutex)
     int             id;         // Client job id
+    handle_t        handle;     // Global handle of the job, valid for any client
+    int             sub_id;     // Target of a fan-out job (id.sub_id), 0 for a single job
     pthread_rwlock_t attr_rw; // Lock for accessing the job status
     status_e        status;     // Status of this job
 } job_t;
@@ -110,17 +241,100 @@ pthread_rwlock_t printer_list_rw;
 /* RW lock to synchronize client list access */
 pthread_rwlock_t client_list_rw;
 
-/* Job Worker prototype */
-void* job_worker(void* args);
+/* Global list of printer groups */
+list_head_t group_list;
+
+/* Group of all known printers ("print any") */
+group_t* any_group;
+
+/* Mutex for groups, their heaps and the printers' load */
+pthread_mutex_t group_mutex;
+
+/* Limits of admission control, 0 means unlimited */
+typedef struct {
+    int             client_jobs;  // Jobs a client may have queued
+    int             printer_jobs; // Jobs that may be queued on a printer
+    int             total_jobs;   // Jobs that may be queued on the server
+    long long       bytes;        // Characters that may be in flight (queued, not printed yet)
+} limits_t;
+
+/* Admission limits, set at startup */
+limits_t limits = { 0, 0, 0, 0 };
+
+/* Jobs queued on all printers (guarded by group_mutex) */
+int queued_jobs = 0;
+
+/* Characters in flight on all printers (guarded by group_mutex) */
+long long queued_chars = 0;
+
+/* Print jobs rejected by admission control (guarded by group_mutex) */
+unsigned long long rejected_jobs = 0;
+
+/* Handles of all jobs, for addressing them without their client */
+handle_table_t* job_handles;
+
+/* Printers are known from discovery, a job for an unknown one is rejected */
+int discovery = 0;
+
+/* Spool journal, NULL if the server runs without one */
+journal_t* journal = NULL;
+
+/* Printer step prototype */
+void printer_step(void* arg);
+
+/* Client timeout prototype */
+void client_timeout(void* arg);
 
 /* get status prototype */
 char* get_status(status_e status);
 
-/* Max lines per page */
+/* Size of the reply buffer of a command */
+#define REPLY_SIZE 10000
+
+/* Max lines per page, unless the printer's class says otherwise */
 const int lines_per_page = 5;
 
-/* Cost per page */
-const double page_price = 0.05;
+/* Cost per page in cents, unless the printer's class says otherwise */
+const int page_price = 5;
+
+/* Secret of the admin command, from the key file (-k) or made up at startup */
+uint64_t admin_token;
+
+/* Printer class file (-f), NULL if all printers are of the default class */
+const char* config_path = NULL;
+
+/* Default class of the printers before the class file is applied */
+printer_class_t base_class;
+
+/* Serializes changes of the configuration */
+pthread_mutex_t config_edit_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Finished jobs a client's history keeps until they are invoiced */
+const int history_size = 64;
+
+/* Highest job priority */
+const int max_priority = 9;
+
+/* Waiting time after which a job has caught up one priority level */
+const long long priority_aging_ms = 10000;
+
+/* Pages a client may print per round on a shared printer */
+const long long drr_quantum_pages = 5;
+
+/* Characters a printer prints per step when there is no print delay */
+const int print_chunk = 4096;
+
+/* Seconds a client may stay silent, 0 for no limit */
+int idle_timeout = 0;
+
+/* Seconds a reply may take to reach a client, 0 for no limit */
+int write_stall_timeout = 0;
+
+/* Seconds a detached session is kept for a reconnect */
+int grace_period = 300;
+
+/* Resolution of the timer wheels pacing the printers */
+const unsigned int pacing_tick_us = 100;
 
 
 
@@ -160,317 +374,1348 @@ int invalid_arg_count(int req, int argc, char* retval) {
 /*
    Initializes a printer.
    The given pointer must be initialized.
-   There must exist a printer with the given id
-   that can be opened with open_printer(id).
+   Its device is not opened before the printer starts a job.
 */
 void init_printer(printer_t* printer, int printer_id) {
     list_init(&printer->list_elem);
-    list_init(&printer->jobs.list_elem);        
+    list_init(&printer->flows);
+    list_init(&printer->active);
+    printer->head_credited = 0;
+    printer->current = NULL;
     printer->id = printer_id;
     pthread_rwlock_init(&printer->joblist_rw, NULL);
     pthread_mutex_init(&printer->job_mutex, NULL);
-    pthread_cond_init(&printer->job_cond, NULL);
+    wheel_timer_init(&printer->timer, printer_id, printer_step, printer);
     printer->status = WAITING;
-    printer->fd = open_printer(printer->id);
+    list_init(&printer->groups);
+    printer->queued_chars = 0;
+    printer->queued_jobs = 0;
+    printer->config = config_acquire();
+    printer->class = config_class(printer->config, printer_id);
+    printer->delay_us = printer->class->delay_us;
+    printer->present = 1;
+    device_init(&printer->device, printer_id);
 }
 
 /*
-   Creates a print job.
-   Prints the file with the given name on the printer with the given id.
-   Usage: print printer_id filename
+   Class of a printer in the current configuration.
+   Looked up again only when a new configuration has been installed.
+   Caller must hold the printer's job_mutex.
 */
-void print_cmd_fct(client_t* client, int argc, char** args, char* retval) {
-    printer_t* printer = NULL;
+const printer_class_t* printer_class(printer_t* printer) {
+    if(printer->config->version != config_version()) {
+        config_release(printer->config);
+        printer->config = config_acquire();
+        printer->class = config_class(printer->config, printer->id);
+        pthread_mutex_lock(&group_mutex);
+        printer->delay_us = printer->class->delay_us;
+        pthread_mutex_unlock(&group_mutex);
+    }
+    return printer->class;
+}
 
-    // Check parameter count
-    if(invalid_arg_count(2, argc, retval))
-        return;    
+/*
+   Estimated time until the printer has finished all queued jobs.
+   Caller must hold group_mutex.
+*/
+long long printer_load(printer_t* printer) {
+    return printer->queued_chars * ((long long)printer->delay_us + 1);
+}
 
-    // Create new job
-    job_t* job = malloc(sizeof(job_t));
-    job->status = WAITING;
-    
-    // Check whether given id is valid and printer exists
-    int printer_id = atoi(args[1]);
-    if(printer_id == 0 || !printer_exists(printer_id)) {
-        printf("Error: Printer does not exist or given argument is not a number.\n");
-        job->status = PRINTER_ERROR;
+/*
+   Adds delta characters to the printer's queued load
+   and repositions it in the heaps of all its groups.
+   Caller must hold group_mutex.
+*/
+void add_printer_load(printer_t* printer, long long delta) {
+    printer->queued_chars += delta;
+    queued_chars += delta;
+    long long load = printer_load(printer);
+    for(list_head_t *ptr = printer->groups.next; ptr != &printer->groups; ptr = ptr->next) {
+        group_member_t* member = (group_member_t*)ptr;
+        // A retired printer is in no heap
+        if(member->heap_node.index != -1)
+            heap_update(&member->group->load_heap, &member->heap_node, load);
+    }
+}
+
+/*
+   Counts a job that is admitted (delta 1) or over (delta -1)
+   towards the limits of its client, its printer and the server.
+*/
+void count_job(client_t* client, printer_t* printer, int delta) {
+    pthread_mutex_lock(&group_mutex);
+    client->queued_jobs += delta;
+    printer->queued_jobs += delta;
+    queued_jobs += delta;
+    pthread_mutex_unlock(&group_mutex);
+}
+
+/*
+   Estimated seconds until a job of the given printer (or of any printer,
+   if NULL) is over: the average time of a queued job, spread over all
+   printers if any printer will do. At least one second.
+   Caller must hold group_mutex.
+*/
+long long retry_after(printer_t* printer) {
+    long long delay = (long long)(printer ? printer->delay_us : get_print_delay()) + 1;
+    long long us;
+    if(printer) {
+        us = printer->queued_jobs ? printer->queued_chars / printer->queued_jobs * delay : 0;
     } else {
-        // Check whether the printer is already in the list
-        int printer_found = 0;
-        if(pthread_rwlock_rdlock(&printer_list_rw) == 0) {
-            for(list_head_t *ptr = printer_list.next; ptr != &printer_list; ptr = ptr->next) {
-                printer = (printer_t*)ptr;
-                if(printer_id == printer->id) {
-                    printer_found = 1;
-                    printf("Printer found in list.\n");
-                    break;
-                }
+        us = queued_jobs ? queued_chars / queued_jobs * delay : 0;
+        if(any_group->size)
+            us /= any_group->size;
+    }
+    return us / 1000000 + 1;
+}
+
+/*
+   Admission control: reserves a queue slot on each printer a print job
+   targets (NULL targets are skipped), or rejects the job if that would
+   exceed a limit. The targets' load of chars each must already be accounted,
+   a rejected job's load is released again.
+   Returns 0 if admitted, -1 if rejected with the reason and a hint
+   when to retry in retval.
+*/
+int admit_jobs(client_t* client, printer_t** printers, int count, long long chars, char* retval) {
+    int jobs = 0;
+    printer_t* full = NULL;     // Printer that has no slot left
+
+    pthread_mutex_lock(&group_mutex);
+    for(int i = 0; i < count; i++) {
+        if(!printers[i])
+            continue;
+        jobs++;
+        // A printer may be targeted more than once
+        int slots = 1;
+        for(int j = 0; j < i; j++)
+            slots += printers[j] == printers[i];
+        if(limits.printer_jobs && printers[i]->queued_jobs + slots > limits.printer_jobs)
+            full = printers[i];
+    }
+
+    if(limits.client_jobs && client->queued_jobs + jobs > limits.client_jobs) {
+        sprintf(retval, "  Rejected: you have %d jobs queued (limit %d), retry after %lld s.\n",
+                client->queued_jobs, limits.client_jobs, retry_after(NULL));
+    } else if(limits.total_jobs && queued_jobs + jobs > limits.total_jobs) {
+        sprintf(retval, "  Rejected: %d jobs queued on the server (limit %d), retry after %lld s.\n",
+                queued_jobs, limits.total_jobs, retry_after(NULL));
+    } else if(full) {
+        sprintf(retval, "  Rejected: %d jobs queued on printer %d (limit %d), retry after %lld s.\n",
+                full->queued_jobs, full->id, limits.printer_jobs, retry_after(full));
+    } else if(limits.bytes && queued_chars > limits.bytes && queued_chars > jobs * chars) {
+        // A job larger than the limit is still admitted when nothing else is in flight
+        long long over = queued_chars - limits.bytes;
+        long long delay = (long long)get_print_delay() + 1;
+        sprintf(retval, "  Rejected: %lld bytes in flight, %lld more exceed the limit of %lld, retry after %lld s.\n",
+                queued_chars - jobs * chars, jobs * chars, limits.bytes,
+                over * delay / (any_group->size ? any_group->size : 1) / 1000000 + 1);
+    } else {
+        for(int i = 0; i < count; i++) {
+            if(printers[i]) {
+                client->queued_jobs++;
+                printers[i]->queued_jobs++;
+                queued_jobs++;
             }
-        } else {
-            printf("Error read-locking printer list lock! Could not start print job. \n");
-            job->status = PRINTER_ERROR;
         }
-        pthread_rwlock_unlock(&printer_list_rw);
+        pthread_mutex_unlock(&group_mutex);
+        return 0;
+    }
 
-        // If not: put it in the list
-        if(!printer_found && job->status != PRINTER_ERROR) {
-            printer = malloc(sizeof(printer_t));
-            init_printer(printer, printer_id);
+    for(int i = 0; i < count; i++) {
+        if(printers[i])
+            add_printer_load(printers[i], -chars);
+    }
+    rejected_jobs++;
+    pthread_mutex_unlock(&group_mutex);
+    return -1;
+}
 
-            pthread_rwlock_wrlock(&printer_list_rw);
-            list_add_tail(&printer->list_elem, &printer_list);
-            pthread_rwlock_unlock(&printer_list_rw);
-        
-            printf("Added new printer to list.\n");
-        }
+/*
+   Accounts printed (or dropped) characters of a job:
+   they no longer count towards the printer's load.
+*/
+void release_job_load(job_t* job, long long chars) {
+    if(!job->printer)
+        return;
+    pthread_mutex_lock(&group_mutex);
+    if(chars > job->queued_chars)
+        chars = job->queued_chars;
+    job->queued_chars -= chars;
+    add_printer_load(job->printer, -chars);
+    pthread_mutex_unlock(&group_mutex);
+}
+
+/* Milliseconds of a monotonic clock */
+long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+   Returns the sub-queue of the client on the printer, creates it if necessary.
+   Caller must hold the printer's joblist_rw for writing.
+*/
+flow_t* get_flow(printer_t* printer, int client_id) {
+    for(list_head_t *ptr = printer->flows.next; ptr != &printer->flows; ptr = ptr->next) {
+        flow_t* flow = (flow_t*)ptr;
+        if(flow->client_id == client_id)
+            return flow;
     }
+    flow_t* flow = calloc(1, sizeof(flow_t));
+    list_init(&flow->list_elem);
+    list_init(&flow->active_elem);
+    flow->client_id = client_id;
+    heap_init(&flow->queue);
+    list_add_tail(&flow->list_elem, &printer->flows);
+    return flow;
+}
 
-    // Init job
-    job->printer = printer;
-    job->client = client;
-    list_init(&job->client_list_elem.list_elem);
-    list_init(&job->printer_list_elem.list_elem);
-    job->filename = malloc(strlen(args[2]) * sizeof(char));
-    strcpy(job->filename, args[2]);
-    job->page_count = 0;
-    pthread_rwlock_init(&job->attr_rw, NULL);
-    
-    // Put job in client's job list
-    client->job_counter++;
-    job->id = client->job_counter;
-    job->client_list_elem.data = (void*)job;
-    pthread_rwlock_wrlock(&client->joblist_rw);
-    list_add_tail(&job->client_list_elem.list_elem, &client->jobs.list_elem);
-    pthread_rwlock_unlock(&client->joblist_rw);
+/* Job waiting at the front of a flow */
+job_t* flow_head(flow_t* flow) {
+    return heap_entry(heap_top(&flow->queue), job_t, queue_node);
+}
 
-    // Put job in printer's job list (in case it exists)
-    job->printer_list_elem.data = (void*)job;
-    if(printer) {
-        pthread_rwlock_wrlock(&printer->joblist_rw);
-        list_add_tail(&job->printer_list_elem.list_elem, &printer->jobs.list_elem);
-        pthread_rwlock_unlock(&printer->joblist_rw);
+/*
+   Removes a flow without waiting jobs from the printer's active ring.
+   Caller must hold the printer's joblist_rw for writing.
+*/
+void deactivate_flow(printer_t* printer, flow_t* flow) {
+    if(printer->active.next == &flow->active_elem)
+        printer->head_credited = 0;
+    list_del(&flow->active_elem);
+    flow->deficit = 0;
+}
+
+/*
+   Picks the next job for the printer by deficit round robin over the
+   clients' flows, weighted by pages: the flow at the front of the ring
+   gets a quantum when its turn comes and prints as long as its deficit
+   covers the next job, then the turn passes on to the next flow.
+   Instead of passing the turn on visit by visit until some deficit
+   suffices, the visits are counted and credited to all flows at once.
+   Caller must hold the printer's joblist_rw for writing.
+*/
+job_t* schedule_next(printer_t* printer) {
+    if(list_empty(&printer->active))
+        return NULL;
+
+    flow_t* head = heap_entry(printer->active.next, flow_t, active_elem);
+    if(!printer->head_credited) {
+        head->deficit += drr_quantum_pages;
+        printer->head_credited = 1;
     }
 
-    // Create job worker thread
-    int error = pthread_create(&(job->tid), NULL, job_worker, job);
-    if (error) {
-        sprintf(retval, "  Failed to create job worker thread: %s\n", strerror(error));
-        
-        pthread_rwlock_wrlock(&client->joblist_rw);
-        list_del(&job->client_list_elem.list_elem);
-        pthread_rwlock_unlock(&client->joblist_rw);
+    flow_t* winner = head;
+    if(flow_head(head)->est_pages > head->deficit) {
+        // The turn passes on: the flow at position k (head is last at n)
+        // prints at visit number (visits - 1) * n + k
+        int n = 0;
+        for(list_head_t *ptr = printer->active.next; ptr != &printer->active; ptr = ptr->next)
+            n++;
+        long long win_step = -1;
+        int k = 0;
+        for(list_head_t *ptr = head->active_elem.next; k < n; ptr = ptr->next) {
+            if(ptr == &printer->active)
+                continue;
+            flow_t* flow = heap_entry(ptr, flow_t, active_elem);
+            k++;
+            long long missing = flow_head(flow)->est_pages - flow->deficit;
+            long long visits = missing <= 0 ? 1 : (missing + drr_quantum_pages - 1) / drr_quantum_pages;
+            long long step = (visits - 1) * n + k;
+            if(win_step < 0 || step < win_step) {
+                win_step = step;
+                winner = flow;
+            }
+        }
 
-        if(printer) {
-            pthread_rwlock_wrlock(&printer->joblist_rw);
-            list_del(&job->printer_list_elem.list_elem);
-            pthread_rwlock_unlock(&printer->joblist_rw);
+        // Credit the visits up to the winner's one
+        k = 0;
+        for(list_head_t *ptr = head->active_elem.next; k < n; ptr = ptr->next) {
+            if(ptr == &printer->active)
+                continue;
+            flow_t* flow = heap_entry(ptr, flow_t, active_elem);
+            k++;
+            if(win_step >= k)
+                flow->deficit += ((win_step - k) / n + 1) * drr_quantum_pages;
         }
 
-        free(job->filename);
-        free(job);
-        return;
+        // The winner is the front of the ring now
+        while(printer->active.next != &winner->active_elem)
+            list_move_tail(printer->active.next, &printer->active);
+        printer->head_credited = 1;
     }
- 
-    sprintf(retval, "  Created job no. %d\n", job->id);
-    //print_job_list(&job->printer->jobs);
+
+    job_t* job = heap_entry(heap_pop(&winner->queue), job_t, queue_node);
+    winner->deficit -= job->est_pages;
+    if(heap_empty(&winner->queue))
+        deactivate_flow(printer, winner);
+
+    long long wait_ms = now_ms() - job->enqueue_ms;
+    winner->jobs_served++;
+    winner->wait_ms_total += wait_ms;
+    if(wait_ms > winner->wait_ms_max)
+        winner->wait_ms_max = wait_ms;
+    return job;
 }
 
-char* get_status(status_e status) {
-    char* result = malloc(strlen("printer error!")*sizeof(char));
-    switch(status) {
-        case WAITING:       sprintf(result, "waiting"); break;
-        case IN_PROGRESS:   sprintf(result, "printing"); break;
-        case CANCELED:      sprintf(result, "cancelled"); break;
-        case FINISHED:      sprintf(result, "finished"); break;
-        case PRINTER_ERROR: sprintf(result, "printer error"); break;
-        case FILE_ERROR:    sprintf(result, "file error"); break;
-        default:            sprintf(result, "invalid state"); break;
+/*
+   Puts a job in its client's sub-queue on the printer.
+   Within the sub-queue the key is the submission time, moved back by the
+   priority: waiting jobs age towards the front, so a job of priority p is
+   overtaken by later jobs of priority p + 1 only for priority_aging_ms.
+   If the printer is idle the next job becomes its current job right away.
+*/
+void enqueue_job(job_t* job) {
+    printer_t* printer = job->printer;
+    job->enqueue_ms = now_ms();
+    long long key = job->enqueue_ms - job->priority * priority_aging_ms;
+    pthread_rwlock_wrlock(&printer->joblist_rw);
+    job->flow = get_flow(printer, job->client->id);
+    heap_push(&job->flow->queue, &job->queue_node, key);
+    if(list_empty(&job->flow->active_elem))
+        list_add_tail(&job->flow->active_elem, &printer->active);
+    if(!printer->current)
+        printer->current = schedule_next(printer);
+    pthread_rwlock_unlock(&printer->joblist_rw);
+}
+
+/*
+   Removes a job from its printer's queue.
+   If it was the printer's current job, the next one takes over.
+   Returns 1 if the current job changed, 0 otherwise.
+*/
+int dequeue_job(job_t* job) {
+    printer_t* printer = job->printer;
+    int changed = 0;
+    pthread_rwlock_wrlock(&printer->joblist_rw);
+    if(printer->current == job) {
+        printer->current = schedule_next(printer);
+        changed = 1;
+    } else if(job->queue_node.index >= 0) {
+        heap_remove(&job->flow->queue, &job->queue_node);
+        if(heap_empty(&job->flow->queue))
+            deactivate_flow(printer, job->flow);
     }
-    return result;
+    pthread_rwlock_unlock(&printer->joblist_rw);
+    return changed;
 }
 
 /*
-   Queries the status of a job.
-   Usage: status job_id
+   Removes a job from its printer's queue and releases its load.
+   If it was the printer's current job, the next one takes over.
 */
-void status_cmd_fct(client_t* client, int argc, char** args, char* retval) {
-    // Check parameter count
-    if(invalid_arg_count(1, argc, retval))
+void remove_job_from_printer(job_t* job) {
+    if(!job->printer)
         return;
+    dequeue_job(job);
+    release_job_load(job, job->queued_chars);
+    count_job(job->client, job->printer, -1);
+}
 
-    int job_id = atoi(args[1]);
-    job_t* job;
-    int job_found = 0;
-    for(list_head_t *ptr = client->jobs.list_elem.next; ptr != &client->jobs.list_elem; ptr = ptr->next) {
-        list_elem_t* list_elem = (list_elem_t*)ptr;
-        job = (job_t*)list_elem->data;
-        if(job->id == job_id) {
-            job_found = 1;
-            printf("Job found in list.\n");
-            break;
-        }
+/*
+   Returns the group with the given name or NULL.
+   Caller must hold group_mutex.
+*/
+group_t* find_group(char* name) {
+    for(list_head_t *ptr = group_list.next; ptr != &group_list; ptr = ptr->next) {
+        group_t* group = (group_t*)ptr;
+        if(!strcmp(group->name, name))
+            return group;
     }
+    return NULL;
+}
 
-    if(job_found) {
-        pthread_rwlock_rdlock(&job->attr_rw);
+/*
+   Creates a new empty group and puts it in the group list.
+   Caller must hold group_mutex.
+*/
+group_t* create_group(char* name) {
+    group_t* group = malloc(sizeof(group_t));
+    list_init(&group->list_elem);
+    snprintf(group->name, MAX_CANON, "%s", name);
+    heap_init(&group->load_heap);
+    group->size = 0;
+    list_add_tail(&group->list_elem, &group_list);
+    return group;
+}
 
-        char* status = get_status(job->status);
-        sprintf(retval, "  Job %d has status '%s'.\n", job_id, status);
-        free(status);
-        
-        pthread_rwlock_unlock(&job->attr_rw);
-    } else {
-        sprintf(retval, "  Job %s could not be found. \n", args[1]);
+/*
+   Adds a printer to a group unless it is already a member.
+   Caller must hold group_mutex.
+*/
+void join_group(group_t* group, printer_t* printer) {
+    for(list_head_t *ptr = printer->groups.next; ptr != &printer->groups; ptr = ptr->next) {
+        if(((group_member_t*)ptr)->group == group)
+            return;
+    }
+    group_member_t* member = malloc(sizeof(group_member_t));
+    list_init(&member->list_elem);
+    heap_node_init(&member->heap_node);
+    member->group = group;
+    member->printer = printer;
+    if(printer->present && heap_push(&group->load_heap, &member->heap_node, printer_load(printer)) == -1) {
+        free(member);
+        return;
     }
+    list_add_tail(&member->list_elem, &printer->groups);
+    group->size++;
+}
 
-    return;
+/*
+   NUMA node of the spooler (timer wheel thread) that drives a printer,
+   -1 if there is no placement policy for spoolers.
+*/
+int printer_node(int printer_id) {
+    timer_wheel_stats_t wheels;
+    timer_wheel_stats(&wheels);
+    return placement_node(PLACE_SPOOLERS, (unsigned int)printer_id % wheels.wheels);
 }
 
 /*
-   Queries the invoice of a job.
-   Waits for that job to finish, if it has not finished yet.
-   Usage: invoice job_id
+   Returns the known printer with the given id, NULL if there is none.
 */
-void invoice_cmd_fct(client_t* client, int argc, char** args, char* retval) {
-    // Check parameter count
-    if(invalid_arg_count(1, argc, retval))
-        return;
+printer_t* find_printer(int printer_id) {
+    printer_t* printer = NULL;
 
-    int job_id = atoi(args[1]);
-    job_t* job;
-    int job_found = 0;
-    for(list_head_t *ptr = client->jobs.list_elem.next; ptr != &client->jobs.list_elem; ptr = ptr->next) {
-        list_elem_t* list_elem = (list_elem_t*)ptr;
-        job = (job_t*)list_elem->data;
-        if(job->id == job_id) {
-            job_found = 1;
-            printf("Job found in list.\n");
+    if(pthread_rwlock_rdlock(&printer_list_rw) != 0) {
+        printf("Error read-locking printer list lock! Could not start print job. \n");
+        return NULL;
+    }
+    for(list_head_t *ptr = printer_list.next; ptr != &printer_list; ptr = ptr->next) {
+        if(printer_id == ((printer_t*)ptr)->id) {
+            printer = (printer_t*)ptr;
             break;
         }
     }
-    
-    if(job_found) {
-        void* thread_retval;
-        
-        pthread_rwlock_rdlock(&job->attr_rw);
-        if(job->status == WAITING || job->status == CANCELED) { // Maybe the job hasn't noticed yet that it was cancelled because it is sleeping
-            printf("Cancel thread as it might be sleeping\n");
-            pthread_rwlock_unlock(&job->attr_rw);
-            // We dont want to wait until the job awakens when some print job finishes
-            pthread_cancel(job->tid);
-            // Remove this job from the printer's joblist as it cannot do that itself anymore
-            printf("Removing it from printer's joblist as it cannot do that itself anymore...\n");
-            pthread_rwlock_wrlock(&job->printer->joblist_rw);
-            list_del(&job->printer_list_elem.list_elem);
-            pthread_rwlock_unlock(&job->printer->joblist_rw);
-        } else {
-            printf("Waiting for job %d to finish...\n", job->id);
-            pthread_rwlock_unlock(&job->attr_rw);
-            pthread_join(job->tid, &thread_retval);
-        }
-        printf("Thread finished.\n");
-        
-        double total = 0.0;
-        pthread_rwlock_rdlock(&job->attr_rw);
-        if(job->status != FILE_ERROR && job->status != PRINTER_ERROR) {
-            total = page_price * job->page_count;
-        }
-        char* status = get_status(job->status);
-        if(job->status == PRINTER_ERROR) {
-            sprintf(retval, "  Job %d: status '%s', printed %d pages. %.2f total.\n", job->id, status, job->page_count, total);
-        } else {
-            sprintf(retval, "  Job %d, printer %d: status '%s', printed %d pages. %.2f total.\n", job->id, job->printer->id, status, job->page_count, total);
-        }
-        free(status);
-        pthread_rwlock_unlock(&job->attr_rw);
+    pthread_rwlock_unlock(&printer_list_rw);
+    return printer;
+}
 
-        pthread_rwlock_wrlock(&client->joblist_rw);
-        list_del(&job->client_list_elem.list_elem);
-        pthread_rwlock_unlock(&client->joblist_rw);
+/*
+   Creates the printer with the given id and puts it in the printer list,
+   unless it is known already. Returns the printer.
+*/
+printer_t* register_printer(int printer_id) {
+    printer_t* printer;
 
-        free(job->filename);
-        free(job);
-        printf("Removed job from client %d's job list.\n", client->id);
-    } else {
-        sprintf(retval, "  Job %s could not be found. \n", args[1]);
+    pthread_rwlock_wrlock(&printer_list_rw);
+    // Somebody else might have been faster
+    for(list_head_t *ptr = printer_list.next; ptr != &printer_list; ptr = ptr->next) {
+        if(((printer_t*)ptr)->id == printer_id) {
+            pthread_rwlock_unlock(&printer_list_rw);
+            return (printer_t*)ptr;
+        }
     }
-
-    return;
+    // Near the spooler that will drive it
+    printer = placement_alloc(sizeof(printer_t), printer_node(printer_id));
+    init_printer(printer, printer_id);
+    list_add_tail(&printer->list_elem, &printer_list);
+    pthread_rwlock_unlock(&printer_list_rw);
+
+    pthread_mutex_lock(&group_mutex);
+    join_group(any_group, printer);
+    pthread_mutex_unlock(&group_mutex);
+
+    printf("Added new printer to list.\n");
+    return printer;
 }
 
 /*
-   Cancels a job if it hasn't finished yet or is in erroneous state.
+   Returns the printer with the given id.
+   With discovery only printers whose device is present are known;
+   otherwise a printer is created on its first use if its device exists.
+   Returns NULL if there is no such printer.
 */
-void cancel_job(int job_id, client_t* client, char* retval) {
-    job_t* job;
-    int job_found = 0;
-    pthread_rwlock_rdlock(&client->joblist_rw);
-    printf("  cancel_job: Looking for job...\n");
-    for(list_head_t *ptr = client->jobs.list_elem.next; ptr != &client->jobs.list_elem; ptr = ptr->next) {
-        list_elem_t* list_elem = (list_elem_t*)ptr;
-        job = (job_t*)list_elem->data;
-        if(job->id == job_id) {
-            job_found = 1;
-            break;
-        }
+printer_t* get_printer(int printer_id) {
+    if(printer_id <= 0 || (!discovery && !printer_exists(printer_id))) {
+        printf("Error: Printer does not exist or given argument is not a number.\n");
+        return NULL;
     }
-    pthread_rwlock_unlock(&client->joblist_rw);
-    
-    if(job_found) {
-        printf("  cancel_job: Job found. Setting state to cancelled...\n");
-        pthread_rwlock_wrlock(&job->attr_rw);
-        if(job->status == IN_PROGRESS) {
-            job->status = CANCELED;
-            sprintf(retval, "  Job %d was cancelled.\n", job->id);
-            // Don't remove it from printer list: job worker thread does that itself
-        } else if(job->status == WAITING || job->status == CANCELED) {
-            job->status = CANCELED;
-            printf("  cancel_job: Sending thread cancel signal as it might be sleeping...\n");
-            pthread_cancel(job->tid);
-            printf("  cancel_job: Job was cancelled.  Removing it from printer's joblist as it cannot do that itself anymore...\n");
-            // Remove job from printer list as it cannot remove itself as it has been cancelled
-            pthread_rwlock_wrlock(&job->printer->joblist_rw);
-            list_del(&job->printer_list_elem.list_elem);
-            pthread_rwlock_unlock(&job->printer->joblist_rw);
-            sprintf(retval, "  Job %d was cancelled.\n", job->id);
-        } else {
-            sprintf(retval, "  Job %d has already finished or is in error state.\n", job->id);
-        }
-        pthread_rwlock_unlock(&job->attr_rw);
-    } else {
-        sprintf(retval, "  Job %d could not be found. \n", job_id);
+
+    printer_t* printer = find_printer(printer_id);
+    if(printer && __atomic_load_n(&printer->present, __ATOMIC_ACQUIRE)) {
+        printf("Printer found in list.\n");
+        return printer;
     }
-    printf("  cancel_job: Ready.\n");    
-    return;
+    if(printer || discovery) {
+        printf("Error: Printer %d does not exist.\n", printer_id);
+        return NULL;
+    }
+    return register_printer(printer_id);
 }
 
 /*
-   Cancels a job if it hasn't finished yet or is in erroneous state.
-   Usage: cancel job_id
+   Called by discovery when the device of a printer appeared or vanished.
+   A new printer is registered. A retired printer leaves the load heaps
+   of its groups, so no job is placed on it, and its jobs fail at their
+   next step; it takes part again once its device is back.
 */
-void cancel_cmd_fct(client_t* client, int argc, char** args, char* retval) {
-    // Check parameter count
-    if(invalid_arg_count(1, argc, retval))
-        return;
+void printer_discovered(unsigned int printer_no, int present) {
+    printer_t* printer = find_printer(printer_no);
+    if(!printer) {
+        if(!present)
+            return;
+        printer = register_printer(printer_no);
+    }
+
+    pthread_mutex_lock(&group_mutex);
+    __atomic_store_n(&printer->present, present, __ATOMIC_RELEASE);
+    for(list_head_t *ptr = printer->groups.next; ptr != &printer->groups; ptr = ptr->next) {
+        group_member_t* member = (group_member_t*)ptr;
+        if(present && member->heap_node.index == -1)
+            heap_push(&member->group->load_heap, &member->heap_node, printer_load(printer));
+        else if(!present && member->heap_node.index != -1)
+            heap_remove(&member->group->load_heap, &member->heap_node);
+    }
+    pthread_mutex_unlock(&group_mutex);
 
-    int job_id = atoi(args[1]);
-    cancel_job(job_id, client, retval);
+    printf("Printer %u %s.\n", printer_no, present ? "discovered" : "retired, its device vanished");
+    if(!present) {
+        // A device that comes back is opened afresh
+        device_invalidate(&printer->device);
+        wheel_timer_kick(&printer->timer);
+    }
 }
 
 /*
-   Queries a list of all jobs that have been created for the given printer.
-   Usage: jobs printer_id
+   Picks the printer of the group that will be done first
+   and accounts the given job size to it.
+   Returns NULL if the group does not exist or is empty.
 */
-void jobs_cmd_fct(client_t* calling_lient, int argc, char** args, char* retval) {
-    // Check parameter count
-    if(invalid_arg_count(1, argc, retval))
-        return;
-
+printer_t* place_job(char* group_name, long long chars) {
+    printer_t* printer = NULL;
+    pthread_mutex_lock(&group_mutex);
+    group_t* group = group_name ? find_group(group_name) : any_group;
+    if(group) {
+        heap_node_t* top = heap_top(&group->load_heap);
+        if(top) {
+            printer = heap_entry(top, group_member_t, heap_node)->printer;
+            add_printer_load(printer, chars);
+        }
+    }
+    pthread_mutex_unlock(&group_mutex);
+    return printer;
+}
+
+/*
+   Writes the current state of a job to the spool journal.
+*/
+void journal_job(job_t* job, journal_event_e event, int durable) {
+    if(!journal)
+        return;
+    journal_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.event = event;
+    record.client_id = job->client->id;
+    record.job_id = job->id;
+    record.sub_id = job->sub_id;
+    record.token = job->client->token;
+    record.printer_id = job->printer ? job->printer->id : 0;
+    record.priority = job->priority;
+    record.status = job->status;
+    record.page_count = job->page_count;
+    record.offset = job->offset;
+    snprintf(record.filename, sizeof(record.filename), "%s", job->filename);
+    if(journal_append(journal, &record, durable) == -1)
+        printf("Error: Could not write job %d of client %d to the journal.\n", job->id, job->client->id);
+}
+
+/*
+   Number of pages of a job on the page geometry of its class,
+   0 if its file could not be read. Even an empty file takes a page.
+*/
+int job_pages(job_t* job) {
+    if(!job->content)
+        return 0;
+    long long lines = job->content->index.lines;
+    int per_page = job->class->lines_per_page;
+    return lines ? (lines + per_page - 1) / per_page : 1;
+}
+
+/*
+   Creates a job of the client for the given printer,
+   no printer means printer error.
+   The job takes over the reference to the file's content.
+   The job's load must already be accounted to the printer.
+*/
+job_t* create_job(client_t* client, printer_t* printer, const char* filename, int priority, file_content_t* content, long long chars) {
+    job_t* job = malloc(sizeof(job_t));
+    job->status = printer ? WAITING : PRINTER_ERROR;
+    job->printer = printer;
+    job->client = client;
+    list_init(&job->client_list_elem.list_elem);
+    job->client_list_elem.data = (void*)job;
+    heap_node_init(&job->queue_node);
+    job->flow = NULL;
+    job->priority = priority;
+    job->sub_id = 0;
+    job->queued_chars = printer ? chars : 0;
+    job->content = content;
+    job->config = config_acquire();
+    job->class = config_class(job->config, printer ? printer->id : 0);
+    job->est_pages = content ? job_pages(job) : 1;
+    if(content) {
+        job->filename = content->path;
+    } else {
+        job->filename = malloc((strlen(filename) + 1) * sizeof(char));
+        strcpy(job->filename, filename);
+    }
+    job->page_count = 0;
+    job->billed_pages = 0;
+    job->ledger = NULL;
+    job->offset = 0;
+    cancel_token_init(&job->cancel);
+    job->handle = handle_alloc(job_handles, job);
+    job->done = 0;
+    pthread_rwlock_init(&job->attr_rw, NULL);
+    return job;
+}
+
+/*
+   Writes an amount of cents as "euros.cents" to buf.
+*/
+char* format_cents(long long cents, char* buf) {
+    sprintf(buf, "%s%lld.%02lld", cents < 0 ? "-" : "", llabs(cents) / 100, llabs(cents) % 100);
+    return buf;
+}
+
+/*
+   Charges a job's pages to its client's ledger: sets the pages charged
+   for the job to pages, the ledger gets the difference.
+   Called by the job's printer (or before the job starts).
+*/
+void bill_job(job_t* job, int pages) {
+    client_t* client = job->client;
+    long long delta = pages - job->billed_pages;
+    if(!delta || !job->printer)
+        return;
+
+    pthread_mutex_lock(&client->ledger_mutex);
+    if(!job->ledger) {
+        for(list_head_t *ptr = client->ledger.next; ptr != &client->ledger; ptr = ptr->next) {
+            ledger_entry_t* entry = (ledger_entry_t*)ptr;
+            if(entry->printer_id == job->printer->id) {
+                job->ledger = entry;
+                break;
+            }
+        }
+        if(!job->ledger) {
+            job->ledger = calloc(1, sizeof(ledger_entry_t));
+            job->ledger->printer_id = job->printer->id;
+            list_add_tail(&job->ledger->list_elem, &client->ledger);
+        }
+    }
+    job->ledger->pages += delta;
+    job->ledger->cents += delta * job->class->page_price;
+    client->billed_pages += delta;
+    client->billed_cents += delta * job->class->page_price;
+    pthread_mutex_unlock(&client->ledger_mutex);
+    job->billed_pages = pages;
+}
+
+/*
+   Frees a job that is in no list anymore.
+*/
+void free_job(job_t* job) {
+    // Waits for commands of other clients that hold the job
+    handle_release(job_handles, job->handle);
+    if(!job->content)
+        free(job->filename);
+    file_cache_put(job->content);
+    config_release(job->config);
+    pthread_rwlock_destroy(&job->attr_rw);
+    free(job);
+}
+
+/*
+   Marks a job as over, it will not print anymore.
+   Wakes up whoever waits for its invoice.
+*/
+void job_done(job_t* job) {
+    client_t* client = job->client;
+    pthread_mutex_lock(&client->done_mutex);
+    job->done = 1;
+    pthread_cond_broadcast(&client->done_cond);
+    pthread_mutex_unlock(&client->done_mutex);
+}
+
+/*
+   Waits until a job is over.
+*/
+void wait_job(job_t* job) {
+    client_t* client = job->client;
+    pthread_mutex_lock(&client->done_mutex);
+    while(!job->done)
+        pthread_cond_wait(&client->done_cond, &client->done_mutex);
+    pthread_mutex_unlock(&client->done_mutex);
+}
+
+/*
+   Ends a job on its printer: removes it from the queue, sets its
+   final status and wakes up whoever waits for it.
+   Caller must hold the printer's job_mutex.
+*/
+void finish_job(job_t* job) {
+    remove_job_from_printer(job);
+
+    pthread_rwlock_wrlock(&job->attr_rw);
+    if(job->status == IN_PROGRESS) {
+        printf("    printer: Finished printing: Client %d, job %d, printer %d, printed pages %d\n", job->client->id, job->id, job->printer->id, job->page_count);
+        job->status = FINISHED;
+    }
+    pthread_rwlock_unlock(&job->attr_rw);
+
+    journal_job(job, JOURNAL_FINISHED, 0);
+    job_done(job);
+}
+
+/*
+   Puts a job in its client's job list and its printer's queue
+   and wakes up the printer if it is idle.
+   A job without printer is over right away.
+*/
+void start_job(job_t* job) {
+    client_t* client = job->client;
+
+    pthread_rwlock_wrlock(&client->joblist_rw);
+    list_add_tail(&job->client_list_elem.list_elem, &client->jobs.list_elem);
+    pthread_rwlock_unlock(&client->joblist_rw);
+
+    if(job->printer) {
+        enqueue_job(job);
+        wheel_timer_kick(&job->printer->timer);
+    } else {
+        job_done(job);
+    }
+}
+
+/*
+   Finds the printer for a print target: a printer id, "any" for the
+   least loaded printer or "@name" for the least loaded printer of a group.
+   Accounts the job's characters to the printer's load.
+   Returns NULL if there is no such printer.
+*/
+printer_t* target_printer(char* target, long long chars) {
+    if(!strcmp(target, "any") || target[0] == '@') {
+        // Let the pool choose the printer
+        printer_t* printer = place_job(target[0] == '@' ? target + 1 : NULL, chars);
+        if(!printer)
+            printf("Error: No printer available in '%s'.\n", target);
+        return printer;
+    }
+
+    // Check whether given id is valid and printer exists
+    printer_t* printer = get_printer(atoi(target));
+    if(printer) {
+        pthread_mutex_lock(&group_mutex);
+        add_printer_load(printer, chars);
+        pthread_mutex_unlock(&group_mutex);
+    }
+    return printer;
+}
+
+/*
+   Writes the name of a job to buf: "N", or "N.k" for target k of a fan-out job.
+*/
+char* job_name(job_t* job, char* buf) {
+    if(job->sub_id) {
+        sprintf(buf, "%d.%d", job->id, job->sub_id);
+    } else {
+        sprintf(buf, "%d", job->id);
+    }
+    return buf;
+}
+
+/*
+   Collects the jobs of a client a job reference addresses:
+   "N" is job N with all its targets, "N.k" only target k of job N.
+   Returns the number of jobs found, *jobs has to be freed.
+*/
+int find_jobs(client_t* client, char* ref, job_t*** jobs) {
+    int job_id = atoi(ref);
+    char* dot = strchr(ref, '.');
+    int sub_id = dot ? atoi(dot + 1) : -1;
+    int count = 0;
+    int capacity = 4;
+
+    *jobs = malloc(capacity * sizeof(job_t*));
+    pthread_rwlock_rdlock(&client->joblist_rw);
+    for(list_head_t *ptr = client->jobs.list_elem.next; ptr != &client->jobs.list_elem; ptr = ptr->next) {
+        job_t* job = (job_t*)((list_elem_t*)ptr)->data;
+        if(job->id == job_id && (sub_id < 0 || job->sub_id == sub_id)) {
+            if(count == capacity) {
+                capacity *= 2;
+                *jobs = realloc(*jobs, capacity * sizeof(job_t*));
+            }
+            (*jobs)[count++] = job;
+        }
+    }
+    pthread_rwlock_unlock(&client->joblist_rw);
+    return count;
+}
+
+/*
+   Writes the name of a finished job to buf, like job_name.
+*/
+char* record_name(job_record_t* record, char* buf) {
+    if(record->sub_id) {
+        sprintf(buf, "%d.%d", record->id, record->sub_id);
+    } else {
+        sprintf(buf, "%d", record->id);
+    }
+    return buf;
+}
+
+/*
+   Collects the finished jobs of a client's history a job reference
+   addresses, like find_jobs. Returns the number of jobs found, *records
+   has to be freed. Only the client's own commands use the history.
+*/
+int find_records(client_t* client, char* ref, job_record_t*** records) {
+    int job_id = atoi(ref);
+    char* dot = strchr(ref, '.');
+    int sub_id = dot ? atoi(dot + 1) : -1;
+    int count = 0;
+
+    *records = malloc(history_size * sizeof(job_record_t*));
+    for(int i = 0; client->history && i < history_size; i++) {
+        job_record_t* record = &client->history[i];
+        if(record->id && record->id == job_id && (sub_id < 0 || record->sub_id == sub_id))
+            (*records)[count++] = record;
+    }
+    return count;
+}
+
+/*
+   Moves the finished jobs of a client from its job list to its history
+   and frees them. The oldest finished job that was not invoiced drops out
+   of a full history; its pages stay in the client's ledger.
+   Only called by the client's own worker, so no command waits for a job meanwhile.
+*/
+void compact_jobs(client_t* client) {
+    pthread_rwlock_wrlock(&client->joblist_rw);
+    list_head_t* ptr = client->jobs.list_elem.next;
+    while(ptr != &client->jobs.list_elem) {
+        job_t* job = (job_t*)((list_elem_t*)ptr)->data;
+        ptr = ptr->next;
+
+        pthread_mutex_lock(&client->done_mutex);
+        int done = job->done;
+        pthread_mutex_unlock(&client->done_mutex);
+        if(!done)
+            continue;
+
+        if(!client->history)
+            client->history = calloc(history_size, sizeof(job_record_t));
+        job_record_t* record = &client->history[client->history_next];
+        client->history_next = (client->history_next + 1) % history_size;
+        if(record->id)
+            printf("Client %d: job %d.%d dropped out of the history without invoice.\n", client->id, record->id, record->sub_id);
+
+        record->id = job->id;
+        record->sub_id = job->sub_id;
+        record->printer_id = job->printer ? job->printer->id : 0;
+        record->status = job->status;
+        record->pages = job->page_count;
+        record->billed_pages = job->billed_pages;
+        record->cents = job->billed_pages * job->class->page_price;
+
+        list_del(&job->client_list_elem.list_elem);
+        free_job(job);
+    }
+    pthread_rwlock_unlock(&client->joblist_rw);
+}
+
+/*
+   Creates a print job.
+   Prints the file with the given name on the printer with the given id,
+   on the least loaded printer ("any") or of a group ("@name").
+   A comma separated list of targets prints the file on each of them:
+   the targets share the file's content and the job id N and can be
+   addressed as a whole (N) or one by one (N.1, N.2, ...).
+   Jobs with higher priority are printed first.
+   Usage: print target[,target...] filename [priority]
+          with target = printer_id|any|@group
+*/
+void print_cmd_fct(client_t* client, int argc, char** args, char* retval) {
+    int priority = 0;
+
+    // Check parameter count
+    if(argc != 4 && invalid_arg_count(2, argc, retval))
+        return;    
+    if(argc == 4) {
+        priority = atoi(args[3]);
+        if(priority < 0 || priority > max_priority) {
+            sprintf(retval, "  Priority must be between 0 and %d.\n", max_priority);
+            return;
+        }
+    }
+
+    char** targets;
+    int target_count = makeargv(args[1], ",", &targets);
+    if(target_count < 1) {
+        sprintf(retval, "  No printer given.\n");
+        if(target_count == 0)
+            freemakeargv(targets);
+        return;
+    }
+
+    // The file's size is the load of every target
+    struct stat file_stat;
+    long long chars = stat(args[2], &file_stat) == 0 ? file_stat.st_size : 0;
+
+    printer_t** printers = malloc(target_count * sizeof(printer_t*));
+    for(int i = 0; i < target_count; i++)
+        printers[i] = target_printer(targets[i], chars);
+
+    // Reject the job before anything is read or allocated for it
+    if(admit_jobs(client, printers, target_count, chars, retval) == -1) {
+        free(printers);
+        freemakeargv(targets);
+        return;
+    }
+
+    // Content and page index of the file, usually cached and read only once for all targets
+    file_content_t* content = file_cache_get(args[2]);
+
+    client->job_counter++;
+    job_t** jobs = malloc(target_count * sizeof(job_t*));
+    int last_journaled = -1;
+    for(int i = 0; i < target_count; i++) {
+        printer_t* printer = printers[i];
+        // Every target holds its own reference to the shared content
+        jobs[i] = create_job(client, printer, args[2], priority, i ? file_cache_ref(content) : content, chars);
+        jobs[i]->id = client->job_counter;
+        jobs[i]->sub_id = target_count > 1 ? i + 1 : 0;
+        if(printer)
+            last_journaled = i;
+    }
+
+    // Make sure the targets survive a restart before confirming them,
+    // one sync covers all of them
+    for(int i = 0; i <= last_journaled; i++) {
+        if(jobs[i]->printer)
+            journal_job(jobs[i], JOURNAL_SUBMITTED, i == last_journaled);
+    }
+
+    char* text = string_append(NULL, "");
+    char line[MAX_CANON + 100];
+    char name[32];
+    if(target_count > 1) {
+        sprintf(line, "  Created job no. %d with %d targets\n", client->job_counter, target_count);
+        text = string_append(text, line);
+    }
+    for(int i = 0; i < target_count; i++) {
+        job_t* job = jobs[i];
+        start_job(job);
+        if(target_count > 1) {
+            if(job->printer) {
+                sprintf(line, "    Job %s on printer %d\n", job_name(job, name), job->printer->id);
+            } else {
+                sprintf(line, "    Job %s: printer '%s' not available\n", job_name(job, name), targets[i]);
+            }
+        } else if(job->printer && (!strcmp(args[1], "any") || args[1][0] == '@')) {
+            sprintf(line, "  Created job no. %d on printer %d\n", job->id, job->printer->id);
+        } else {
+            sprintf(line, "  Created job no. %d\n", job->id);
+        }
+        text = string_append(text, line);
+    }
+    snprintf(retval, REPLY_SIZE, "%s", text);
+
+    free(text);
+    free(jobs);
+    free(printers);
+    freemakeargv(targets);
+}
+
+char* get_status(status_e status) {
+    char* result = malloc(strlen("printer error!")*sizeof(char));
+    switch(status) {
+        case WAITING:       sprintf(result, "waiting"); break;
+        case IN_PROGRESS:   sprintf(result, "printing"); break;
+        case CANCELED:      sprintf(result, "cancelled"); break;
+        case FINISHED:      sprintf(result, "finished"); break;
+        case PRINTER_ERROR: sprintf(result, "printer error"); break;
+        case FILE_ERROR:    sprintf(result, "file error"); break;
+        default:            sprintf(result, "invalid state"); break;
+    }
+    return result;
+}
+
+/*
+   Writes the status of a job to line.
+*/
+void job_status(job_t* job, char* line) {
+    char name[32];
+    pthread_rwlock_rdlock(&job->attr_rw);
+
+    char* status = get_status(job->status);
+    if(job->status == IN_PROGRESS) {
+        sprintf(line, "  Job %s has status '%s' (page %d of %d).\n", job_name(job, name), status, job->page_count, job_pages(job));
+    } else {
+        sprintf(line, "  Job %s has status '%s'.\n", job_name(job, name), status);
+    }
+    free(status);
+
+    pthread_rwlock_unlock(&job->attr_rw);
+}
+
+/*
+   Parses a job handle "#hex" and returns the job it addresses, locked
+   by its handle (release with handle_unlock). NULL if the handle is
+   stale, the reference is not a handle or the job belongs to another
+   client and client is no admin (handles are easy to guess).
+*/
+job_t* lock_job_handle(client_t* client, char* ref) {
+    if(ref[0] != '#')
+        return NULL;
+    job_t* job = (job_t*)handle_lock(job_handles, strtoull(ref + 1, NULL, 16));
+    if(job && job->client != client && !client->admin) {
+        handle_unlock(job_handles);
+        return NULL;
+    }
+    return job;
+}
+
+/*
+   Queries the status of a job or of each target of a fan-out job.
+   A handle (#hex, see jobs) addresses a job of the client, an admin's
+   one of any client.
+   Usage: status job_id[.target]|#handle
+*/
+void status_cmd_fct(client_t* client, int argc, char** args, char* retval) {
+    // Check parameter count
+    if(invalid_arg_count(1, argc, retval))
+        return;
+
+    char line[200];
+    char name[32];
+    if(args[1][0] == '#') {
+        job_t* job = lock_job_handle(client, args[1]);
+        if(job) {
+            job_status(job, line);
+            sprintf(retval, "  Client %d:%s", job->client->id, line + 1);
+            handle_unlock(job_handles);
+        } else {
+            sprintf(retval, "  Job %s could not be found. \n", args[1]);
+        }
+        return;
+    }
+
+    job_t** jobs;
+    int count = find_jobs(client, args[1], &jobs);
+    char* text = string_append(NULL, "");
+    for(int i = 0; i < count; i++) {
+        job_status(jobs[i], line);
+        text = string_append(text, line);
+    }
+
+    job_record_t** records;
+    int finished = find_records(client, args[1], &records);
+    for(int i = 0; i < finished; i++) {
+        char* status = get_status(records[i]->status);
+        sprintf(line, "  Job %s has status '%s'.\n", record_name(records[i], name), status);
+        free(status);
+        text = string_append(text, line);
+    }
+
+    if(count + finished) {
+        snprintf(retval, REPLY_SIZE, "%s", text);
+    } else {
+        sprintf(retval, "  Job %s could not be found. \n", args[1]);
+    }
+    free(text);
+    free(jobs);
+    free(records);
+}
+
+/*
+   Queries the price of a job before it is printed,
+   for a fan-out job also the price of all targets.
+   Usage: quote job_id[.target]
+*/
+void quote_cmd_fct(client_t* client, int argc, char** args, char* retval) {
+    // Check parameter count
+    if(invalid_arg_count(1, argc, retval))
+        return;
+
+    job_t** jobs;
+    int count = find_jobs(client, args[1], &jobs);
+    char* text = string_append(NULL, "");
+    char line[MAX_CANON + 100];
+    char name[32];
+    char money[32];
+    int pages = 0;
+    long long cents = 0;
+    for(int i = 0; i < count; i++) {
+        job_t* job = jobs[i];
+        if(job_pages(job) == 0) {
+            sprintf(line, "  Job %s: file '%s' could not be read.\n", job_name(job, name), job->filename);
+        } else {
+            sprintf(line, "  Job %s: %d pages (%lld lines). %s total.\n", job_name(job, name), job_pages(job),
+                    job->content->index.lines, format_cents((long long)job->class->page_price * job_pages(job), money));
+        }
+        pages += job_pages(job);
+        cents += (long long)job->class->page_price * job_pages(job);
+        text = string_append(text, line);
+    }
+
+    // Finished jobs are quoted with the pages they printed
+    job_record_t** records;
+    int finished = find_records(client, args[1], &records);
+    for(int i = 0; i < finished; i++) {
+        job_record_t* record = records[i];
+        sprintf(line, "  Job %s: %d pages printed. %s total.\n", record_name(record, name), record->pages,
+                format_cents(record->cents, money));
+        pages += record->pages;
+        cents += record->cents;
+        text = string_append(text, line);
+    }
+    free(records);
+    count += finished;
+
+    if(!count) {
+        sprintf(retval, "  Job %s could not be found. \n", args[1]);
+    } else {
+        if(count > 1) {
+            sprintf(line, "  Job %s: %d targets, %d pages. %s total.\n", args[1], count, pages, format_cents(cents, money));
+            text = string_append(text, line);
+        }
+        snprintf(retval, REPLY_SIZE, "%s", text);
+    }
+    free(text);
+    free(jobs);
+}
+
+/*
+   Cancels a job if it hasn't finished yet or is in erroneous state.
+   A waiting job is taken off the queue right away, a printing one
+   is stopped by its printer's next step, which comes immediately.
+*/
+void cancel_job(job_t* job, char* retval) {
+    printer_t* printer = job->printer;
+    char name[32];
+
+    printf("  cancel_job: Setting state of job %s to cancelled...\n", job_name(job, name));
+    if(printer)
+        pthread_mutex_lock(&printer->job_mutex);
+    pthread_rwlock_wrlock(&job->attr_rw);
+    status_e status = job->status;
+    if(status == IN_PROGRESS || status == WAITING || status == CANCELED) {
+        job->status = CANCELED;
+        cancel_token_fire(&job->cancel);
+        sprintf(retval, "  Job %s was cancelled.\n", name);
+    } else {
+        sprintf(retval, "  Job %s has already finished or is in error state.\n", name);
+    }
+    pthread_rwlock_unlock(&job->attr_rw);
+
+    if(status == WAITING) {
+        pthread_rwlock_rdlock(&printer->joblist_rw);
+        int current = printer->current == job;
+        pthread_rwlock_unlock(&printer->joblist_rw);
+        if(current) {
+            // Chosen but not started yet: the printer drops it
+            wheel_timer_schedule(&printer->timer, 0);
+        } else {
+            finish_job(job);
+        }
+    } else if(status == IN_PROGRESS) {
+        wheel_timer_schedule(&printer->timer, 0);
+    }
+    if(printer)
+        pthread_mutex_unlock(&printer->job_mutex);
+    printf("  cancel_job: Ready.\n");    
+}
+
+/*
+   Invoices a job and forgets it.
+   Waits for the job to finish, if it has not finished yet.
+   Writes the invoice to retval, adds the pages charged to pages
+   and returns their price.
+*/
+long long invoice_job(client_t* client, job_t* job, int* pages, char* retval) {
+    char name[32];
+    char money[32];
+
+    pthread_rwlock_rdlock(&job->attr_rw);
+    int waiting = job->status == WAITING;
+    pthread_rwlock_unlock(&job->attr_rw);
+    if(waiting) {
+        // We dont want to wait until the printer gets to the job
+        printf("Cancel job %s as it is still waiting\n", job_name(job, name));
+        cancel_job(job, retval);
+    }
+    printf("Waiting for job %s to finish...\n", job_name(job, name));
+    wait_job(job);
+    printf("Thread finished.\n");
+    
+    int charged = 0;
+    pthread_rwlock_rdlock(&job->attr_rw);
+    if(job->status != FILE_ERROR && job->status != PRINTER_ERROR) {
+        charged = job->page_count;
+    }
+    long long cents = (long long)job->class->page_price * charged;
+    char* status = get_status(job->status);
+    if(job->status == PRINTER_ERROR) {
+        sprintf(retval, "  Job %s: status '%s', printed %d pages. %s total.\n", job_name(job, name), status, job->page_count, format_cents(cents, money));
+    } else {
+        sprintf(retval, "  Job %s, printer %d: status '%s', printed %d pages. %s total.\n", job_name(job, name), job->printer->id, status, job->page_count, format_cents(cents, money));
+    }
+    free(status);
+    pthread_rwlock_unlock(&job->attr_rw);
+
+    pthread_rwlock_wrlock(&client->joblist_rw);
+    list_del(&job->client_list_elem.list_elem);
+    pthread_rwlock_unlock(&client->joblist_rw);
+
+    journal_job(job, JOURNAL_INVOICED, 0);
+    free_job(job);
+    printf("Removed job from client %d's job list.\n", client->id);
+    *pages += charged;
+    return cents;
+}
+
+/*
+   Invoices a finished job of the history and frees its slot.
+   Writes the invoice to retval, adds the pages charged to pages
+   and returns their price.
+*/
+long long invoice_record(client_t* client, job_record_t* record, int* pages, char* retval) {
+    char name[32];
+    char money[32];
+    char* status = get_status(record->status);
+    *pages += record->billed_pages;
+    if(record->printer_id) {
+        sprintf(retval, "  Job %s, printer %d: status '%s', printed %d pages. %s total.\n", record_name(record, name),
+                record->printer_id, status, record->pages, format_cents(record->cents, money));
+    } else {
+        sprintf(retval, "  Job %s: status '%s', printed %d pages. %s total.\n", record_name(record, name),
+                status, record->pages, format_cents(record->cents, money));
+    }
+    free(status);
+    pthread_rwlock_wrlock(&client->joblist_rw);
+    record->id = 0;
+    pthread_rwlock_unlock(&client->joblist_rw);
+    return record->cents;
+}
+
+/*
+   Queries the invoice of a job, of one target or of all targets of a fan-out job.
+   Waits for them to finish, if they have not finished yet.
+   Usage: invoice job_id[.target]
+*/
+void invoice_cmd_fct(client_t* client, int argc, char** args, char* retval) {
+    // Check parameter count
+    if(invalid_arg_count(1, argc, retval))
+        return;
+
+    job_t** jobs;
+    int count = find_jobs(client, args[1], &jobs);
+    char* text = string_append(NULL, "");
+    char line[200];
+    char money[32];
+    int pages = 0;
+    long long cents = 0;
+    for(int i = 0; i < count; i++) {
+        cents += invoice_job(client, jobs[i], &pages, line);
+        text = string_append(text, line);
+    }
+
+    // Finished jobs are invoiced from the history
+    job_record_t** records;
+    int finished = find_records(client, args[1], &records);
+    for(int i = 0; i < finished; i++) {
+        cents += invoice_record(client, records[i], &pages, line);
+        text = string_append(text, line);
+    }
+    free(records);
+    count += finished;
+
+    if(!count) {
+        sprintf(retval, "  Job %s could not be found. \n", args[1]);
+    } else {
+        if(count > 1) {
+            sprintf(line, "  Job %s: %d targets, printed %d pages. %s total.\n", args[1], count, pages, format_cents(cents, money));
+            text = string_append(text, line);
+        }
+        snprintf(retval, REPLY_SIZE, "%s", text);
+    }
+    free(text);
+    free(jobs);
+}
+
+/*
+   Cancels a job, one target or all targets of a fan-out job
+   if they haven't finished yet or are in erroneous state.
+   A handle (#hex, see jobs) addresses a job of the client, an admin's
+   one of any client.
+   Usage: cancel job_id[.target]|#handle
+*/
+void cancel_cmd_fct(client_t* client, int argc, char** args, char* retval) {
+    // Check parameter count
+    if(invalid_arg_count(1, argc, retval))
+        return;
+
+    if(args[1][0] == '#') {
+        job_t* job = lock_job_handle(client, args[1]);
+        if(job) {
+            char line[100];
+            cancel_job(job, line);
+            sprintf(retval, "  Client %d:%s", job->client->id, line + 1);
+            handle_unlock(job_handles);
+        } else {
+            sprintf(retval, "  Job %s could not be found. \n", args[1]);
+        }
+        return;
+    }
+
+    job_t** jobs;
+    int count = find_jobs(client, args[1], &jobs);
+    char* text = string_append(NULL, "");
+    char line[100];
+    for(int i = 0; i < count; i++) {
+        cancel_job(jobs[i], line);
+        text = string_append(text, line);
+    }
+
+    job_record_t** records;
+    int finished = find_records(client, args[1], &records);
+    char name[32];
+    for(int i = 0; i < finished; i++) {
+        sprintf(line, "  Job %s has already finished or is in error state.\n", record_name(records[i], name));
+        text = string_append(text, line);
+    }
+    free(records);
+    count += finished;
+
+    if(count) {
+        snprintf(retval, REPLY_SIZE, "%s", text);
+    } else {
+        sprintf(retval, "  Job %s could not be found. \n", args[1]);
+    }
+    free(text);
+    free(jobs);
+}
+
+/*
+   Queries a list of all jobs that have been created for the given printer.
+   Usage: jobs printer_id
+*/
+void jobs_cmd_fct(client_t* calling_lient, int argc, char** args, char* retval) {
+    // Check parameter count
+    if(invalid_arg_count(1, argc, retval))
+        return;
+
     int printer_id = atoi(args[1]);
     int jobs_found = 0;
     if(pthread_rwlock_rdlock(&client_list_rw) == 0) {
-        char* extension = malloc(126*sizeof(char));
+        char* extension = malloc((MAX_CANON + 126)*sizeof(char));
+        char name[32];
         char* text      = malloc(1*sizeof(char));
         text[0] = 0;
         // Traverse all clients...
@@ -484,7 +1729,19 @@ void jobs_cmd_fct(client_t* calling_lient, int argc, char** args, char* retval)
                 job = (job_t*)list_elem->data;
                 if(job->printer != NULL && job->printer->id == printer_id) {
                     char* status = get_status(job->status);
-                    sprintf(extension, "  Client %d, job %d, file '%s', status '%s'\n", job->client->id, job->id, job->filename, status);
+                    sprintf(extension, "  Client %d, job %s (#%llx), file '%s', priority %d, status '%s'\n", job->client->id, job_name(job, name),
+                            (unsigned long long)job->handle, job->filename, job->priority, status);
+                    free(status);
+                    text = string_append(text, extension);
+                    jobs_found++;
+                }
+            }
+            // Finished jobs not invoiced yet
+            for(int i = 0; client->history && i < history_size; i++) {
+                job_record_t* record = &client->history[i];
+                if(record->id && record->printer_id == printer_id) {
+                    char* status = get_status(record->status);
+                    sprintf(extension, "  Client %d, job %s, status '%s'\n", client->id, record_name(record, name), status);
                     free(status);
                     text = string_append(text, extension);
                     jobs_found++;
@@ -508,15 +1765,178 @@ void jobs_cmd_fct(client_t* calling_lient, int argc, char** args, char* retval)
 }
 
 /*
-   Closes the connection.
-   Cancels all jobs that have been started by the calling client.
-   Usage: quit
+   Appends the statistics of a printer to text.
+   Lists the clients' sub-queues with their waiting times.
 */
-void quit_cmd_fct(client_t* client, int argc, char** args, char* retval) {
-    // Check parameter count
+char* printer_stats(printer_t* printer, char* text) {
+    char line[200];
+    pthread_rwlock_rdlock(&printer->joblist_rw);
+    sprintf(line, "  Printer %d: %s\n", printer->id, printer->current ? "printing" : "idle");
+    text = string_append(text, line);
+    for(list_head_t *ptr = printer->flows.next; ptr != &printer->flows; ptr = ptr->next) {
+        flow_t* flow = (flow_t*)ptr;
+        long long avg = flow->jobs_served ? flow->wait_ms_total / flow->jobs_served : 0;
+        sprintf(line, "    Client %d: %d queued, %d served, wait avg %lld ms, max %lld ms, deficit %lld pages\n",
+                flow->client_id, flow->queue.size, flow->jobs_served, avg, flow->wait_ms_max, flow->deficit);
+        text = string_append(text, line);
+    }
+    pthread_rwlock_unlock(&printer->joblist_rw);
+    return text;
+}
+
+/*
+   Queries server statistics, for all printers or the given one.
+   Usage: stats [printer_id]
+*/
+void stats_cmd_fct(client_t* client, int argc, char** args, char* retval) {
+    if(argc > 2 && invalid_arg_count(1, argc, retval))
+        return;
+
+    int printer_id = argc == 2 ? atoi(args[1]) : 0;
+    char* text = string_append(NULL, "");
+    char line[200];
+
+    if(!printer_id) {
+        file_cache_stats_t cache;
+        file_cache_stats(&cache);
+        unsigned long long lookups = cache.hits + cache.misses;
+        sprintf(line, "  File cache: %d files, %lld of %lld bytes, %llu hits, %llu misses (%.1f%% hit rate)\n",
+                cache.files, cache.bytes, cache.max_bytes, cache.hits, cache.misses,
+                lookups ? 100.0 * cache.hits / lookups : 0.0);
+        text = string_append(text, line);
+
+        timer_wheel_stats_t wheels;
+        timer_wheel_stats(&wheels);
+        sprintf(line, "  Pacing: %d timer threads, %u us tick, %d timers armed, %llu timer callbacks\n",
+                wheels.wheels, wheels.tick_us, wheels.pending, wheels.fired);
+        text = string_append(text, line);
+
+        io_engine_stats_t io;
+        io_engine_stats(&io);
+        sprintf(line, "  I/O engine: %s, %llu submissions, %llu operations (%.1f per submission), %llu errors\n",
+                io.name, io.submissions, io.operations,
+                io.submissions ? (double)io.operations / io.submissions : 0.0, io.errors);
+        text = string_append(text, line);
+
+        device_cache_stats_t devices;
+        device_cache_stats(&devices);
+        sprintf(line, "  Devices: %d open (limit %d), %llu opens, %llu reopens after errors, %llu idle ones closed\n",
+                devices.open, devices.max_open, devices.opens, devices.reopens, devices.evictions);
+        text = string_append(text, line);
+
+        sprintf(line, "  Placement: ");
+        placement_describe(line, sizeof(line) - 1);
+        text = string_append(text, line);
+        text = string_append(text, "\n");
+
+        pthread_mutex_lock(&group_mutex);
+        sprintf(line, "  Admission: %d jobs queued, %lld bytes in flight, %llu jobs rejected\n",
+                queued_jobs, queued_chars, rejected_jobs);
+        pthread_mutex_unlock(&group_mutex);
+        text = string_append(text, line);
+    }
+    pthread_rwlock_rdlock(&printer_list_rw);
+    for(list_head_t *ptr = printer_list.next; ptr != &printer_list; ptr = ptr->next) {
+        printer_t* printer = (printer_t*)ptr;
+        if(!printer_id || printer->id == printer_id)
+            text = printer_stats(printer, text);
+    }
+    pthread_rwlock_unlock(&printer_list_rw);
+
+    if(text[0]) {
+        snprintf(retval, REPLY_SIZE, "%s", text);
+    } else {
+        sprintf(retval, "  No printers in use.\n");
+    }
+    free(text);
+}
+
+/*
+   Lists the known printers with the depth of their queues.
+   Usage: printers
+*/
+void printers_cmd_fct(client_t* client, int argc, char** args, char* retval) {
     if(invalid_arg_count(0, argc, retval))
         return;
-    
+
+    char* text = string_append(NULL, "");
+    char line[PATH_MAX + 100];
+    if(discovery) {
+        char pattern[PATH_MAX];
+        discovery_describe(pattern, sizeof(pattern));
+        snprintf(line, sizeof(line), "  Printers discovered from %s:\n", pattern);
+    } else {
+        snprintf(line, sizeof(line), "  Printers in use (backend '%s' makes them on demand):\n", printer_backend_name());
+    }
+    text = string_append(text, line);
+
+    int count = 0;
+    pthread_rwlock_rdlock(&printer_list_rw);
+    for(list_head_t *ptr = printer_list.next; ptr != &printer_list; ptr = ptr->next) {
+        printer_t* printer = (printer_t*)ptr;
+        pthread_rwlock_rdlock(&printer->joblist_rw);
+        int printing = printer->current != NULL;
+        pthread_rwlock_unlock(&printer->joblist_rw);
+        pthread_mutex_lock(&group_mutex);
+        sprintf(line, "  Printer %d: %s, %s, %d jobs queued, %lld bytes to print, device %s\n", printer->id,
+                printer->present ? "present" : "gone", printing ? "printing" : "idle",
+                printer->queued_jobs, printer->queued_chars, printer->device.open ? "open" : "closed");
+        pthread_mutex_unlock(&group_mutex);
+        text = string_append(text, line);
+        count++;
+    }
+    pthread_rwlock_unlock(&printer_list_rw);
+    if(!count)
+        text = string_append(text, "  None.\n");
+
+    snprintf(retval, REPLY_SIZE, "%s", text);
+    free(text);
+}
+
+/*
+   Creates a printer group or adds printers to it.
+   Jobs can then be placed on the least loaded printer of the group by "print @name file".
+   Usage: group name printer_id...
+*/
+void group_cmd_fct(client_t* client, int argc, char** args, char* retval) {
+    if(argc < 3) {
+        sprintf(retval, "  This command takes at least 2 arguments. Instead received %d.\n", argc - 1);
+        return;
+    }
+    if(!strcmp(args[1], "any")) {
+        sprintf(retval, "  Group 'any' contains all printers and cannot be changed.\n");
+        return;
+    }
+
+    // Resolve the printers first, get_printer needs the group mutex itself
+    int count = argc - 2;
+    printer_t** printers = malloc(count * sizeof(printer_t*));
+    for(int i = 0; i < count; i++) {
+        printers[i] = get_printer(atoi(args[i + 2]));
+        if(!printers[i]) {
+            sprintf(retval, "  Printer %s does not exist.\n", args[i + 2]);
+            free(printers);
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&group_mutex);
+    group_t* group = find_group(args[1]);
+    if(!group)
+        group = create_group(args[1]);
+    for(int i = 0; i < count; i++)
+        join_group(group, printers[i]);
+    sprintf(retval, "  Group '%s' has %d printers.\n", group->name, group->size);
+    pthread_mutex_unlock(&group_mutex);
+
+    free(printers);
+}
+
+/*
+   Cancels all jobs of a client, waits for them and frees them.
+   Returns their invoices, to be freed by the caller.
+*/
+char* end_client_jobs(client_t* client) {
     char* text = malloc(5*sizeof(char));
     char* extension = malloc(200*sizeof(char));
     text[0] = 0;
@@ -528,52 +1948,261 @@ void quit_cmd_fct(client_t* client, int argc, char** args, char* retval) {
         list_elem_t* list_elem = (list_elem_t*)ptr;
         job = (job_t*)list_elem->data;
             
-        cancel_job(job->id, client, extension);
+        cancel_job(job, extension);
+        wait_job(job);
+        text = string_append(text, extension);
+        printf("quit_cmd: Job finished.\n");
+
+        printf("quit_cmd: Free job and delete from list...\n");
+        list_del(&job->client_list_elem.list_elem);
+
+        journal_job(job, JOURNAL_INVOICED, 0);
+        free_job(job);
+        printf("quit_cmd: Ready, next one...\n");
+    }
+    pthread_rwlock_unlock(&client->joblist_rw);
+
+    // and forget the finished ones
+    char name[32];
+    pthread_rwlock_wrlock(&client->joblist_rw);
+    for(int i = 0; client->history && i < history_size; i++) {
+        if(client->history[i].id) {
+            sprintf(extension, "  Job %s has already finished or is in error state.\n", record_name(&client->history[i], name));
+            text = string_append(text, extension);
+            client->history[i].id = 0;
+        }
+    }
+    pthread_rwlock_unlock(&client->joblist_rw);
+
+    printf("quit_cmd: Free extension string...\n");
+    free(extension);
+    return text;
+}
+
+/*
+   Closes the connection.
+   Cancels all jobs that have been started by the calling client.
+   Usage: quit
+*/
+void quit_cmd_fct(client_t* client, int argc, char** args, char* retval) {
+    // Check parameter count
+    if(invalid_arg_count(0, argc, retval))
+        return;
+
+    char* text = end_client_jobs(client);
+    snprintf(retval, REPLY_SIZE, "%s", text);
+    free(text);
+
+    printf("quit_cmd: Setting quit signal\n");
+    client->quit = 1;
+    
+    printf("quit_cmd: Quit finished.\n");
+    return;
+}
+
+/*
+   Tells the client its session token. After a dropped connection
+   the session is kept for the grace period and "attach token" from a
+   new connection continues it with all its jobs.
+   Usage: session
+*/
+void session_cmd_fct(client_t* client, int argc, char** args, char* retval) {
+    if(invalid_arg_count(0, argc, retval))
+        return;
+    sprintf(retval, "  Session of client %d, token %016llx. After a reconnect within %d s, 'attach %016llx' resumes it.\n",
+            client->id, (unsigned long long)client->token, grace_period, (unsigned long long)client->token);
+}
+
+/*
+   Continues a detached session on this connection: its jobs and job
+   numbers are the client's again, nothing is printed anew.
+   Only a connection that has not started jobs yet can attach.
+   Usage: attach token
+*/
+void attach_cmd_fct(client_t* client, int argc, char** args, char* retval) {
+    if(invalid_arg_count(1, argc, retval))
+        return;
+    if(client->job_counter) {
+        sprintf(retval, "  Cannot attach: this session has jobs of its own.\n");
+        return;
+    }
+    uint64_t token = strtoull(args[1], NULL, 16);
+
+    client_t* session = NULL;
+    pthread_rwlock_wrlock(&client_list_rw);
+    for(list_head_t *ptr = client_list.next; ptr != &client_list; ptr = ptr->next) {
+        client_t* elem = (client_t*)ptr;
+        if(elem != client && elem->token == token && !elem->connection) {
+            session = elem;
+            break;
+        }
+    }
+    if(session) {
+        // The session's grace period ends, it belongs to this connection now
+        pthread_mutex_lock(&session->con_mutex);
+        session->connection = client->connection;
+        session->waiting_for = NULL;
+        wheel_timer_cancel(&session->timer);
+        if(client->admin)
+            session->admin = 1;
+        pthread_mutex_unlock(&session->con_mutex);
+        client->attach = session;
+    }
+    pthread_rwlock_unlock(&client_list_rw);
+
+    if(!session) {
+        sprintf(retval, "  No detached session with this token.\n");
+        return;
+    }
+    pthread_rwlock_rdlock(&session->joblist_rw);
+    int jobs = 0;
+    for(list_head_t *ptr = session->jobs.list_elem.next; ptr != &session->jobs.list_elem; ptr = ptr->next)
+        jobs++;
+    pthread_rwlock_unlock(&session->joblist_rw);
+    sprintf(retval, "  Attached to session of client %d with %d jobs, last job no. %d.\n",
+            session->id, jobs, session->job_counter);
+}
+
+/*
+   Makes the client an admin if it knows the admin token, which the
+   server prints at startup or reads from its key file (-k).
+   Usage: admin token
+*/
+void admin_cmd_fct(client_t* client, int argc, char** args, char* retval) {
+    if(invalid_arg_count(1, argc, retval))
+        return;
+    if(strtoull(args[1], NULL, 16) != admin_token) {
+        printf("Client %d gave a wrong admin token.\n", client->id);
+        sprintf(retval, "  Wrong admin token.\n");
+        return;
+    }
+    client->admin = 1;
+    sprintf(retval, "  Client %d is an admin now.\n", client->id);
+}
 
-        pthread_rwlock_rdlock(&job->attr_rw);
-        if(job->status != WAITING && job->status != CANCELED) {
-            pthread_rwlock_unlock(&job->attr_rw);
-            void* thread_retval;
-            pthread_join(job->tid, &thread_retval);
-        } else {
-            pthread_rwlock_unlock(&job->attr_rw);
-        }
-        text = string_append(text, extension);
-        printf("quit_cmd: Job finished.\n");
-        
-        //pthread_rwlock_rdlock(&job->attr_rw);
-        //if(job->status == IN_PROGRESS) {
-        //    pthread_cond_broadcast(&job->printer->job_cond);
-        //    pthread_mutex_unlock(&job->printer->job_mutex);
-        //}
-        //pthread_rwlock_unlock(&job->attr_rw);
-        //pthread_mutex_lock(&printer->job_mutex);
-        //pthread_cond_broadcast(&printer->job_cond);
-        //pthread_mutex_unlock(&printer->job_mutex);
-        
-        //void* thread_retval;
-        //pthread_join(job->tid, &thread_retval);
+/*
+   Returns what the client has been charged so far, in total and per
+   printer, from the ledger kept up to date as pages are printed.
+   Jobs count with the pages begun, whether invoiced yet or not.
+   Usage: bill
+*/
+void bill_cmd_fct(client_t* client, int argc, char** args, char* retval) {
+    if(invalid_arg_count(0, argc, retval))
+        return;
 
-        printf("quit_cmd: Free job and delete from list...\n");
-        list_del(&job->client_list_elem.list_elem);
+    char* text = string_append(NULL, "");
+    char line[200];
+    char money[32];
+    pthread_mutex_lock(&client->ledger_mutex);
+    sprintf(line, "  Client %d: %lld pages. %s total.\n", client->id, client->billed_pages,
+            format_cents(client->billed_cents, money));
+    text = string_append(text, line);
+    for(list_head_t *ptr = client->ledger.next; ptr != &client->ledger; ptr = ptr->next) {
+        ledger_entry_t* entry = (ledger_entry_t*)ptr;
+        sprintf(line, "    Printer %d: %lld pages. %s\n", entry->printer_id, entry->pages,
+                format_cents(entry->cents, money));
+        text = string_append(text, line);
+    }
+    pthread_mutex_unlock(&client->ledger_mutex);
 
-        free(job->filename);
-        free(job);
-        printf("quit_cmd: Ready, next one...\n");
+    snprintf(retval, REPLY_SIZE, "%s", text);
+    free(text);
+}
+
+/*
+   Builds the configuration from the default class and the class file
+   (if there is one). Returns NULL with a message in error if the file
+   cannot be read or is malformed.
+*/
+printer_config_t* load_config(char* error, size_t len) {
+    printer_config_t* config = config_create(&base_class);
+    if(config_path && config_load(config, config_path, error, len) == -1) {
+        config_release(config);
+        return NULL;
     }
-    pthread_rwlock_unlock(&client->joblist_rw);
+    return config;
+}
 
-    sprintf(retval, "%s", text);
-    
-    printf("quit_cmd: Free extension string...\n");
+/*
+   Makes config the current configuration (taking over the reference).
+   Printers pick up their new class at their next step, jobs keep the
+   class they were created with.
+*/
+void apply_config(printer_config_t* config) {
+    printer_config_t* old = config_acquire();
+    int rescan = strcmp(old->tty_path, config->tty_path);
+    config_release(old);
+    if(rescan)
+        set_tty_path(config->tty_path);
+    // Server wide estimates use the delay of the default class
+    set_print_delay(config->class[0].delay_us);
+    config_install(config);
+    if(rescan && discovery)
+        discovery_rescan();
+}
 
-    free(extension);
-    free(text);
-    printf("quit_cmd: Setting quit signal\n");
-    client->quit = 1;
-    
-    printf("quit_cmd: Quit finished.\n");
-    return;
+/*
+   Shows or changes the printer classes at runtime.
+   "reload" reads the class file again (-f), "set" changes one setting
+   of a class (created if new) or the tty path. Printers print with the
+   delay of their new class from the next character on; queued jobs keep
+   the page geometry and price they were created with.
+   Usage: config [reload | set class key value | set tty_path pattern]
+*/
+void config_cmd_fct(client_t* client, int argc, char** args, char* retval) {
+    char error[300];
+    printer_config_t* config = NULL;
+
+    // Everybody may look, only an admin may change the configuration
+    if(argc > 1 && !client->admin) {
+        sprintf(retval, "  Only an admin can change the configuration (see admin).\n");
+        return;
+    }
+    pthread_mutex_lock(&config_edit_mutex);
+    if(argc == 2 && !strcmp(args[1], "reload")) {
+        if(!(config = load_config(error, sizeof(error)))) {
+            sprintf(retval, "  Configuration not changed: %s\n", error);
+            pthread_mutex_unlock(&config_edit_mutex);
+            return;
+        }
+    } else if(argc >= 3 && !strcmp(args[1], "set")) {
+        int global = !strcmp(args[2], "tty_path");
+        int first = global ? 3 : 4;
+        if(argc < first) {
+            sprintf(retval, "  Usage: config set class key value\n");
+            pthread_mutex_unlock(&config_edit_mutex);
+            return;
+        }
+        // The value may have spaces (form_feed)
+        char* value = string_append(NULL, "");
+        for(int i = first; i < argc; i++) {
+            value = string_append(value, i > first ? " " : "");
+            value = string_append(value, args[i]);
+        }
+        printer_config_t* current = config_acquire();
+        config = config_copy(current);
+        config_release(current);
+        int result = config_set(config, global ? NULL : args[2], args[global ? 2 : 3], value, error, sizeof(error));
+        free(value);
+        if(result == -1) {
+            config_release(config);
+            sprintf(retval, "  Configuration not changed: %s\n", error);
+            pthread_mutex_unlock(&config_edit_mutex);
+            return;
+        }
+    } else if(argc != 1) {
+        sprintf(retval, "  Usage: config [reload | set class key value | set tty_path pattern]\n");
+        pthread_mutex_unlock(&config_edit_mutex);
+        return;
+    }
+    if(config)
+        apply_config(config);
+    pthread_mutex_unlock(&config_edit_mutex);
+
+    config = config_acquire();
+    retval[0] = 0;
+    config_describe(config, retval, REPLY_SIZE);
+    config_release(config);
 }
 
 /*
@@ -597,157 +2226,329 @@ void init_commands() {
     add_command("print", &print_cmd_fct); 
     add_command("status", &status_cmd_fct);
     add_command("invoice", &invoice_cmd_fct);
+    add_command("quote", &quote_cmd_fct);
     add_command("cancel", &cancel_cmd_fct);
     add_command("jobs", &jobs_cmd_fct);
+    add_command("group", &group_cmd_fct);
+    add_command("printers", &printers_cmd_fct);
+    add_command("stats", &stats_cmd_fct);
+    add_command("bill", &bill_cmd_fct);
     add_command("quit", &quit_cmd_fct);
+    add_command("session", &session_cmd_fct);
+    add_command("attach", &attach_cmd_fct);
+    add_command("config", &config_cmd_fct);
+    add_command("admin", &admin_cmd_fct);
 }
 
 
 
-/////////////////
-// THREADS
-
+/*
+   Empties a page.
+*/
+void clear_page(page_t* page) {
+    page->segs = 0;
+    page->cur = 0;
+    page->pos = 0;
+    page->body_chars = 0;
+}
 
 /*
- * Job-Worker Thread
- * Executes the attached job.
- */
-void* job_worker(void *arg) {
-    job_t* job = (job_t*)arg;
-    printer_t* printer = job->printer;
+   Appends a segment to a page, unless it is empty.
+*/
+void add_segment(page_t* page, const char* buf, size_t len) {
+    if(!len)
+        return;
+    page->seg[page->segs] = buf;
+    page->seg_len[page->segs] = len;
+    page->segs++;
+}
 
-    // For proper cancel handling
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+/* Top and bottom line of banner pages */
+const char banner_rule[] = "########################################\n";
 
-    if(!printer) {
-        return NULL;
+/*
+   Rendering stage: lays out a banner page announcing a job,
+   followed by the separator of its class.
+*/
+void render_banner(job_t* job, page_t* page) {
+    char name[32];
+    char money[32];
+    clear_page(page);
+    int len = sprintf(page->head, "%s#  Job %s of client %d\n#  File %.200s\n#  %d pages, %s\n%s",
+                      banner_rule, job_name(job, name), job->client->id, job->filename, job_pages(job),
+                      format_cents((long long)job->class->page_price * job_pages(job), money), banner_rule);
+    memcpy(page->head + len, job->class->form_feed, job->class->form_feed_len);
+    add_segment(page, page->head, len + job->class->form_feed_len);
+}
+
+/*
+   Rendering stage: lays out the next page of a job from the job's offset
+   on: the separator (not before the first page of this run), the job
+   header and the page number if the class asks for them, and the page's
+   lines, which stay in the file's content. Advances the job's offset.
+*/
+void render_page(job_t* job, page_t* page) {
+    const printer_class_t* class = job->class;
+    const char* data = job->content->map.data;
+    long long len = job->content->map.len;
+    char name[32];
+
+    clear_page(page);
+    int head = 0;
+    if(page->count) {
+        memcpy(page->head, class->form_feed, class->form_feed_len);
+        head = class->form_feed_len;
     }
+    if(class->header)
+        head += sprintf(page->head + head, "%.200s, job %s of client %d\n", job->filename, job_name(job, name), job->client->id);
+    add_segment(page, page->head, head);
+
+    // The page's lines, up to and including the newline of the last one
+    long long end = job->offset;
+    for(int line = 0; line < class->lines_per_page && end < len; line++) {
+        const char* newline = memchr(data + end, '\n', len - end);
+        end = newline ? newline - data + 1 : len;
+    }
+    add_segment(page, data + job->offset, end - job->offset);
+    page->body_chars = end - job->offset;
+    job->offset = end;
 
-    // Sleep until this job is at top of the printer's job list
-    pthread_mutex_lock(&printer->job_mutex);
-    while(1) {
-        pthread_rwlock_rdlock(&printer->joblist_rw);
-        if(printer->jobs.list_elem.next != &job->printer_list_elem.list_elem) {
-            pthread_rwlock_unlock(&printer->joblist_rw);
-            // This is NOT the next job
-            // Check if the job has been canceled
-            printf("    jobworker: Job %d here, but it's not my turn. Check if I have been canceled...\n", job->id);
-            pthread_rwlock_rdlock(&job->attr_rw);
-            if(job->status == CANCELED) {
-                pthread_rwlock_unlock(&job->attr_rw);
-                break;
-            }
-            pthread_rwlock_unlock(&job->attr_rw);
+    if(class->page_numbers)
+        add_segment(page, page->tail, sprintf(page->tail, "Page %d of %d\n", job->page_count, job_pages(job)));
+    page->count++;
+}
 
-            pthread_cond_wait(&printer->job_cond, &printer->job_mutex);
-        } else {
-            // This IS the next job
-            pthread_rwlock_unlock(&printer->joblist_rw);
-            break;
+/*
+   A page of a job has been printed and the next one begins: counts and
+   charges it, the printed page leaves the printer's load and the journal
+   notes where the new page starts.
+*/
+void next_page(job_t* job, page_t* page) {
+    pthread_rwlock_wrlock(&job->attr_rw);
+    job->page_count++;
+    pthread_rwlock_unlock(&job->attr_rw);
+    bill_job(job, job->page_count);
+    release_job_load(job, page->body_chars);
+    journal_job(job, JOURNAL_PROGRESS, 0);
+}
+
+/*
+   Device writer stage: moves the next bytes of the rendered page to the
+   printer's device, whole segments as far as the budget goes.
+   Returns the bytes written, -1 if the device failed.
+*/
+long long write_page(printer_t* printer, page_t* page, long long budget) {
+    long long written = 0;
+    while(page->cur < page->segs && written < budget) {
+        long long run = page->seg_len[page->cur] - page->pos;
+        if(run > budget - written)
+            run = budget - written;
+        if(device_write(&printer->device, page->seg[page->cur] + page->pos, run) == -1)
+            return -1;
+        written += run;
+        page->pos += run;
+        if(page->pos == page->seg_len[page->cur]) {
+            page->cur++;
+            page->pos = 0;
         }
     }
-    
-    // This job is at top of the printer's job list, check file to read and start printing!
-    char* line = NULL;
-    size_t len = 0;
-    ssize_t read;
-    int aborted = 0;
-    int line_count = 0;
-
-    job->fd = fopen(job->filename, "r");
-    if (job->fd == NULL) {
-        pthread_rwlock_wrlock(&job->attr_rw);
-        job->status = FILE_ERROR;
-        pthread_rwlock_unlock(&job->attr_rw);
-        aborted = 1;
-        printf("    jobworker: Could not read file %s.\n", job->filename);
-    } else {
-        pthread_rwlock_rdlock(&job->attr_rw);
-        if(job->status == CANCELED) {
-            printf("    jobworker: Job canceled: Client %d, job %d, printer %d\n", job->client->id, job->id, job->printer->id);
-            aborted = 1;
-        } else {
-            printf("    jobworker: Start printing: Client %d, job %d, printer %d\n", job->client->id, job->id, job->printer->id);
-            pthread_rwlock_unlock(&job->attr_rw);
-            pthread_rwlock_wrlock(&job->attr_rw);
-            job->status = IN_PROGRESS;
-            job->page_count = 1;
-        }
-        pthread_rwlock_unlock(&job->attr_rw);
-
-        while(!aborted && (read = getline(&line, &len, job->fd)) != -1) {
-            line_count++;
-            for(int i = 0; i < strlen(line) && !aborted; i++) {       
-                // Check whether the printer is available
-                if(!printer_exists(printer->id)) {
-                    pthread_rwlock_wrlock(&job->attr_rw);
-                    job->status = PRINTER_ERROR;
-                    pthread_rwlock_unlock(&job->attr_rw);
-                    aborted = 1;
-                    printf("    jobworker: Job error: Printer %d became unavailable.\n", job->printer->id);
-                    break;
-                }
-               
-                // Page full? 
-                if(line_count > lines_per_page) {
-                    print_char(printer->fd, '\n');
-                    pthread_rwlock_wrlock(&job->attr_rw);
-                    job->page_count++;
-                    pthread_rwlock_unlock(&job->attr_rw);
-                    line_count = 1;
-                }
+    return written;
+}
 
-                //printf("Next char is: %c\n", job->text[i]); 
-                print_char(printer->fd, line[i]);
+/*
+   Ends a job whose printer's device failed and could not be reopened.
+   Returns 1 (the job is over).
+*/
+int device_failed(job_t* job) {
+    pthread_rwlock_wrlock(&job->attr_rw);
+    job->status = PRINTER_ERROR;
+    pthread_rwlock_unlock(&job->attr_rw);
+    // A job in error is not charged
+    bill_job(job, 0);
+    printf("    printer: Job error: Printer %d failed.\n", job->printer->id);
+    return 1;
+}
 
-                // Check whether the job has been canceled 
-                pthread_rwlock_rdlock(&job->attr_rw);
-                if(job->status == CANCELED) {
-                    pthread_rwlock_unlock(&job->attr_rw);
-                    aborted = 1;
-                    printf("    jobworker: Job canceled: Client %d, job %d, printer %d\n", job->client->id, job->id, job->printer->id);
-                    break;
-                }
-                pthread_rwlock_unlock(&job->attr_rw);
+/*
+   The last page of a job has been handed to the device writer: the job
+   is over once its output has reached the device.
+   Returns 1 (the job is over).
+*/
+int job_printed(job_t* job) {
+    // The I/O engine may still hold the end of it
+    if(device_flush(&job->printer->device) == -1)
+        return device_failed(job);
+    return 1;
+}
+
+/*
+   Prints the next characters of a printer's current job, at most budget:
+   renders its pages one by one and hands them to the device writer.
+   Starts the job on its first step.
+   Returns 1 when the job is over (printed, cancelled or failed), 0 otherwise.
+   Caller must hold the printer's job_mutex.
+*/
+int job_step(job_t* job, int budget) {
+    printer_t* printer = job->printer;
+
+    // Check whether the job has been canceled
+    if(cancel_token_cancelled(&job->cancel)) {
+        printf("    printer: Job canceled: Client %d, job %d, printer %d\n", job->client->id, job->id, printer->id);
+        return 1;
+    }
+
+    pthread_rwlock_wrlock(&job->attr_rw);
+    if(job->status == WAITING) {
+        if(!job->content) {
+            job->status = FILE_ERROR;
+            printf("    printer: Could not read file %s.\n", job->filename);
+        } else if(device_acquire(&printer->device) == -1) {
+            job->status = PRINTER_ERROR;
+            printf("    printer: Could not open printer %d on backend '%s'.\n", printer->id, printer_backend_name());
+        } else {
+            printf("    printer: Start printing: Client %d, job %d, printer %d\n", job->client->id, job->id, printer->id);
+            job->status = IN_PROGRESS;
+            if(job->offset > 0) {
+                // Resumed after a restart: continue on the page where it stopped
+                printf("    printer: Resuming at byte %lld, page %d\n", job->offset, job->page_count);
+            } else {
+                job->page_count = 1;
             }
+            bill_job(job, job->page_count);
+            journal_job(job, JOURNAL_STARTED, 0);
+            // The printer's page belongs to this job now
+            clear_page(&printer->page);
+            printer->page.count = 0;
+            if(job->class->banner && job->offset == 0)
+                render_banner(job, &printer->page);
+        }
+    }
+    int printing = job->status == IN_PROGRESS;
+    pthread_rwlock_unlock(&job->attr_rw);
+    if(!printing)
+        return 1;
+
+    page_t* page = &printer->page;
+    long long len = job->content->map.len;
+    while(budget > 0) {
+        // Check whether the printer is available
+        if(!__atomic_load_n(&printer->present, __ATOMIC_ACQUIRE)) {
+            pthread_rwlock_wrlock(&job->attr_rw);
+            job->status = PRINTER_ERROR;
+            pthread_rwlock_unlock(&job->attr_rw);
+            // A job in error is not charged
+            bill_job(job, 0);
+            printf("    printer: Job error: Printer %d became unavailable.\n", printer->id);
+            return 1;
         }
-        fclose(job->fd);
-        if (line) {
-            free(line);
+
+        if(page->cur == page->segs) {
+            // Page written: render the next one, if there is one
+            if(page->count && job->offset >= len)
+                return job_printed(job);
+            if(page->count)
+                next_page(job, page);
+            render_page(job, page);
+            continue;
         }
+
+        long long written = write_page(printer, page, budget);
+        if(written == -1)
+            return device_failed(job);
+        budget -= written;
     }
+    if(page->cur == page->segs && page->count && job->offset >= len)
+        return job_printed(job);
+    return 0;
+}
 
-    // Remove this job from the printer's joblist
-    printf("    jobworker: Removing myself from printer's joblist\n");
-    pthread_rwlock_wrlock(&printer->joblist_rw);
-    list_del(&job->printer_list_elem.list_elem);
-    pthread_rwlock_unlock(&printer->joblist_rw);
 
-    
-    //print_job_list(&job->printer->jobs);
 
+/////////////////
+// THREADS
 
-    printf("    jobworker: Broadcasting signal\n");
-    pthread_cond_broadcast(&printer->job_cond);
-    pthread_mutex_unlock(&printer->job_mutex);
 
-    // Set this job's status to finished if there was no error / cancellation
-    if(!aborted) {
-        printf("    jobworker: Finished printing: Client %d, job %d, printer %d, printed pages %d\n", job->client->id, job->id, job->printer->id, job->page_count);
-        pthread_rwlock_wrlock(&job->attr_rw);
-        job->status = FINISHED;
-        pthread_rwlock_unlock(&job->attr_rw);
-    } else {
-        printf("    jobworker: Cancellation complete.\n");
+/*
+ * Printer step, called by the printer's timer on a timer wheel thread.
+ * Prints the next character of the current job and rearms the timer for
+ * the next one after the print delay of the printer's class (without delay
+ * a whole chunk per step), so a new configuration applies right away.
+ * At the end of a job the next one starts right away; an idle printer
+ * is not rearmed until start_job kicks it.
+ */
+void printer_step(void* arg) {
+    printer_t* printer = (printer_t*)arg;
+
+    pthread_mutex_lock(&printer->job_mutex);
+    useconds_t delay = printer_class(printer)->delay_us;
+    pthread_rwlock_rdlock(&printer->joblist_rw);
+    job_t* job = printer->current;
+    pthread_rwlock_unlock(&printer->joblist_rw);
+    if(!job) {
+        pthread_mutex_unlock(&printer->job_mutex);
+        return;
     }
 
-    if(list_empty(&job->printer->jobs.list_elem)) {
-        printf("    jobworker: Joblist of printer %d now empty.\n", job->printer->id);
-    } else {
-        printf("    jobworker: Joblist of printer %d is not empty.\n", job->printer->id);
+    if(job_step(job, delay ? 1 : print_chunk)) {
+        finish_job(job);
+        delay = 0;
+        pthread_rwlock_rdlock(&printer->joblist_rw);
+        job = printer->current;
+        pthread_rwlock_unlock(&printer->joblist_rw);
+        if(!job) {
+            printf("    printer: Queue of printer %d now empty.\n", printer->id);
+            device_release(&printer->device);
+        }
     }
+    pthread_mutex_unlock(&printer->job_mutex);
+
+    if(job) {
+        wheel_timer_schedule(&printer->timer, delay);
+    }
+}
 
+/*
+ * Returns a random session token.
+ */
+uint64_t new_token() {
+    uint64_t token = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if(fd == -1 || read(fd, &token, sizeof(token)) != sizeof(token))
+        token = ((uint64_t)now_ms() << 24) ^ ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+    if(fd != -1)
+        close(fd);
+    return token;
+}
+
+/*
+ * Frees a client that is in no list anymore and has no jobs.
+ * Not to be called from the client's timeout.
+ */
+void free_client(client_t* client) {
+    // Its timeout may still be running on a timer wheel
+    wheel_timer_cancel_sync(&client->timer);
+    pthread_rwlock_destroy(&client->joblist_rw);
+    pthread_mutex_destroy(&client->done_mutex);
+    pthread_cond_destroy(&client->done_cond);
+    pthread_mutex_destroy(&client->con_mutex);
+    while(!list_empty(&client->ledger))
+        free(list_del(client->ledger.next));
+    pthread_mutex_destroy(&client->ledger_mutex);
+    free(client->history);
+    free(client);
+}
+
+/*
+ * Ends a detached session whose grace period is over, like quit:
+ * cancels its jobs and frees it. Runs on a thread of its own as it has to
+ * wait for the printers.
+ */
+void* end_session(void* arg) {
+    client_t* client = (client_t*)arg;
+    char* text = end_client_jobs(client);
+    printf("Session of client %d expired.\n%s", client->id, text);
+    free(text);
+    free_client(client);
     return NULL;
 }
 
@@ -756,14 +2557,174 @@ void* job_worker(void *arg) {
  */
 void init_client(client_t* client, connection_t* con) {
     client->connection = con;
+    client->token = new_token();
+    client->admin = 0;
+    client->attach = NULL;
     client->job_counter = 0;
     client->quit = 0;
+    client->queued_jobs = 0;
     client_count++;
     client->id = client_count;
+    pthread_rwlock_init(&client->joblist_rw, NULL);
+    pthread_mutex_init(&client->done_mutex, NULL);
+    pthread_cond_init(&client->done_cond, NULL);
+    client->history = NULL;
+    client->history_next = 0;
+    pthread_mutex_init(&client->ledger_mutex, NULL);
+    list_init(&client->ledger);
+    client->billed_pages = 0;
+    client->billed_cents = 0;
+    pthread_mutex_init(&client->con_mutex, NULL);
+    wheel_timer_init(&client->timer, client->id, client_timeout, client);
+    client->deadline_ms = 0;
+    client->waiting_for = NULL;
     list_init(&client->jobs.list_elem);
     list_init(&client->list_elem);
 }
 
+/*
+ * Timeout of a client, called on a timer wheel thread.
+ * A connection is shut down, so that the client worker's pending read
+ * or write fails and the worker closes the connection.
+ * A detached session is ended.
+ */
+void client_timeout(void* arg) {
+    client_t* client = (client_t*)arg;
+    pthread_t tid;
+    int expired = 0;
+
+    pthread_rwlock_wrlock(&client_list_rw);
+    pthread_mutex_lock(&client->con_mutex);
+    long long left = client->deadline_ms - now_ms();
+    if (!client->waiting_for) {
+        // Attached or closed meanwhile
+    } else if (left > 0) {
+        // Timeouts beyond the range of the wheel fire early
+        wheel_timer_schedule(&client->timer, left * 1000);
+    } else if (client->connection) {
+        fprintf(stderr, "fd=%d: %s timeout, evicting client %s\n",
+                client->connection->com_fd, client->waiting_for, client->connection->client_name);
+        shutdown(client->connection->com_fd, SHUT_RDWR);
+    } else {
+        // Nobody can attach to the session anymore
+        client->waiting_for = NULL;
+        list_del(&client->list_elem);
+        expired = 1;
+    }
+    pthread_mutex_unlock(&client->con_mutex);
+    pthread_rwlock_unlock(&client_list_rw);
+
+    // The session may be freed as soon as the thread runs, it is not touched afterwards
+    if (expired) {
+        if (pthread_create(&tid, NULL, end_session, client) == 0) {
+            pthread_detach(tid);
+        } else {
+            perror("Failed to end session");
+        }
+    }
+}
+
+/*
+ * Arms the timeout of a client for what it waits for next,
+ * no timeout if seconds is 0.
+ */
+void set_client_timeout(client_t* client, int seconds, const char* waiting_for) {
+    pthread_mutex_lock(&client->con_mutex);
+    if (seconds) {
+        client->deadline_ms = now_ms() + seconds * 1000LL;
+        client->waiting_for = waiting_for;
+        wheel_timer_schedule(&client->timer, seconds * 1000000ULL);
+    } else {
+        client->waiting_for = NULL;
+        wheel_timer_cancel(&client->timer);
+    }
+    pthread_mutex_unlock(&client->con_mutex);
+}
+
+/*
+ * Takes the connection from a client,
+ * its timeout must not touch the connection anymore.
+ */
+void release_connection(client_t* client) {
+    pthread_mutex_lock(&client->con_mutex);
+    client->connection = NULL;
+    client->waiting_for = NULL;
+    pthread_mutex_unlock(&client->con_mutex);
+    wheel_timer_cancel_sync(&client->timer);
+}
+
+/*
+ * Detaches a session from its connection: it is kept for the grace
+ * period, then ended unless a new connection attaches to it.
+ */
+void detach_client(client_t* client) {
+    printf("Session of client %d detached, kept for %d s.\n", client->id, grace_period);
+    pthread_mutex_lock(&client->con_mutex);
+    client->deadline_ms = now_ms() + grace_period * 1000LL;
+    client->waiting_for = "reattach";
+    wheel_timer_schedule(&client->timer, grace_period * 1000000ULL);
+    pthread_mutex_unlock(&client->con_mutex);
+}
+
+/*
+ * Returns the client with the given id, creates it without connection
+ * if it does not exist (owner of jobs recovered from the journal).
+ */
+client_t* get_replay_client(int client_id, uint64_t token) {
+    for(list_head_t *ptr = client_list.next; ptr != &client_list; ptr = ptr->next) {
+        if(((client_t*)ptr)->id == client_id)
+            return (client_t*)ptr;
+    }
+    client_t* client = malloc(sizeof(client_t));
+    init_client(client, NULL);
+    client->id = client_id;
+    client->token = token;
+    list_add_tail(&client->list_elem, &client_list);
+    // Its owner can attach to it after reconnecting
+    detach_client(client);
+    return client;
+}
+
+/*
+ * Recreates an unfinished job from the spool journal and starts it again.
+ */
+void replay_job(const journal_record_t* state, void* arg) {
+    client_t* client = get_replay_client(state->client_id, state->token);
+    printer_t* printer = get_printer(state->printer_id);
+
+    file_content_t* content = file_cache_get(state->filename);
+    long long chars = content ? content->map.len - state->offset : 0;
+    if(chars < 0)
+        chars = 0;
+    if(printer) {
+        pthread_mutex_lock(&group_mutex);
+        add_printer_load(printer, chars);
+        pthread_mutex_unlock(&group_mutex);
+    }
+
+    job_t* job = create_job(client, printer, state->filename, state->priority, content, chars);
+    job->id = state->job_id;
+    job->sub_id = state->sub_id;
+    if(client->job_counter < job->id)
+        client->job_counter = job->id;
+    job->page_count = state->page_count;
+    bill_job(job, job->page_count);
+    // Pages are journaled when they begin, the job resumes at the start of one
+    job->offset = state->offset;
+
+    char name[32];
+    printf("Recovered job %s of client %d for printer %d ('%s', %lld bytes printed)\n",
+           job_name(job, name), client->id, state->printer_id, job->filename, job->offset);
+    if(printer) {
+        // Recovered jobs are not subject to admission control
+        count_job(client, printer, 1);
+        start_job(job);
+    } else {
+        journal_job(job, JOURNAL_FINISHED, 0);
+        free_job(job);
+    }
+}
+
 /*
  * Print a list of clients (prints their file descriptor number)
  */
@@ -786,14 +2747,28 @@ void* client_worker(void *arg) {
     connection_t* con = client->connection;
     int bytesread;
     char buf[MAX_CANON];
-    char* reply = malloc(10000*sizeof(char));
+    char* reply = malloc(REPLY_SIZE*sizeof(char));
+    size_t reply_len = 0;   // Reply to send before the next read
 
     fprintf(stderr, "fd=%d: connected to %s\n", con->com_fd, con->client_name);
   
     // read data from client until client quits
     while (client->quit == 0) {
-        // read data from client until client quits
-        bytesread = read(con->com_fd, buf, MAX_CANON-1);
+        // with a write stall timeout the reply is sent on its own, as it times out differently
+        if (reply_len && write_stall_timeout) {
+            set_client_timeout(client, write_stall_timeout, "write stall");
+            bytesread = io_write_read(con->com_fd, reply, reply_len, NULL, 0);
+            reply_len = 0;
+            if (bytesread == -1) {
+                fprintf(stderr, "fd=%d: communication error with client %s\n", 
+                    con->com_fd, con->client_name);
+                break;
+            }
+        }
+        // send the last reply and read data from client, in one go with io_uring
+        set_client_timeout(client, idle_timeout, "idle");
+        bytesread = io_write_read(con->com_fd, reply, reply_len, buf, MAX_CANON-1);
+        reply_len = 0;
         if (bytesread == -1) {
             fprintf(stderr, "fd=%d: communication error with client %s\n", 
                 con->com_fd, con->client_name);
@@ -829,6 +2804,9 @@ void* client_worker(void *arg) {
                 continue;
             }
             
+            // Finished jobs leave the job list for the history
+            compact_jobs(client);
+
             // Traverse commands, compare to first element in args (should be the command name)
             int command_found = 0;
             for(list_head_t *ptr = command_list.next; ptr != &command_list; ptr = ptr->next) {
@@ -846,26 +2824,84 @@ void* client_worker(void *arg) {
             freemakeargv(clean_input);
             freemakeargv(args);
             
-            // reply
-            write(con->com_fd, reply, strlen(reply));
+            // reply, sent together with the next read
+            reply_len = strlen(reply);
+
+            // continue an attached session instead of the new one
+            if (client->attach) {
+                client_t* fresh = client;
+                client = fresh->attach;
+                release_connection(fresh);
+                pthread_rwlock_wrlock(&client_list_rw);
+                list_del(&fresh->list_elem);
+                pthread_rwlock_unlock(&client_list_rw);
+                free_client(fresh);
+            }
         }
     }
+    if (reply_len) {
+        set_client_timeout(client, write_stall_timeout, "write stall");
+        io_write_read(con->com_fd, reply, reply_len, NULL, 0);
+    }
     
     // closing connection
+    release_connection(client);
     fprintf(stderr, "fd=%d: closing connection to client %s\n", 
             con->com_fd, con->client_name);
     if (close(con->com_fd) == -1)
         perror("failed to close com_fd\n");
+    free(reply);
    
-    pthread_rwlock_wrlock(&client_list_rw);
-    list_del(&client->list_elem);
-    pthread_rwlock_unlock(&client_list_rw);
- 
-    free(client);
+    // A client that did not quit may come back for its jobs
+    if (client->quit) {
+        pthread_rwlock_wrlock(&client_list_rw);
+        list_del(&client->list_elem);
+        pthread_rwlock_unlock(&client_list_rw);
+        free_client(client);
+    } else {
+        detach_client(client);
+    }
     
     return NULL;
 }
 
+/*
+ * Parses admission limits: a comma separated list of
+ * client=jobs, printer=jobs, total=jobs and bytes=characters.
+ * Returns 0 or -1 if the list is malformed.
+ */
+int parse_limits(const char* spec, limits_t* result) {
+    char** items;
+    int count = makeargv(spec, ",", &items);
+    if(count < 1) {
+        if(count == 0)
+            freemakeargv(items);
+        return -1;
+    }
+    int error = 0;
+    for(int i = 0; i < count && !error; i++) {
+        char* value = strchr(items[i], '=');
+        if(!value || atoll(value + 1) < 0) {
+            error = 1;
+            break;
+        }
+        *value++ = 0;
+        if(!strcmp(items[i], "client")) {
+            result->client_jobs = atoi(value);
+        } else if(!strcmp(items[i], "printer")) {
+            result->printer_jobs = atoi(value);
+        } else if(!strcmp(items[i], "total")) {
+            result->total_jobs = atoi(value);
+        } else if(!strcmp(items[i], "bytes")) {
+            result->bytes = atoll(value);
+        } else {
+            error = 1;
+        }
+    }
+    freemakeargv(items);
+    return error ? -1 : 0;
+}
+
 /* 
  * Dispatcher Thread
  * Waits for new connections and creates client-worker-threads for these.
@@ -874,6 +2910,11 @@ int main(int argc, char *argv[]) {
     u_port_t port;
     int listenfd;
     connection_t *con;
+    int opt;
+    char *journal_path = NULL;
+    char *key_path = NULL;
+    long long cache_mb = 64;
+    int pacing_threads = 1;
 
     init_commands();
         
@@ -883,13 +2924,137 @@ int main(int argc, char *argv[]) {
     pthread_rwlock_init(&printer_list_rw, NULL);
     pthread_rwlock_init(&client_list_rw, NULL);
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s port\n", argv[0]);
+    job_handles = handle_table_create();
+    list_init(&group_list);
+    pthread_mutex_init(&group_mutex, NULL);
+    any_group = create_group("any");
+
+    while ((opt = getopt(argc, argv, "a:b:c:d:e:f:g:i:j:k:l:m:t:w:")) != -1) {
+        switch (opt) {
+            case 'a':
+                if (placement_parse(optarg) == -1) {
+                    fprintf(stderr, "Invalid placement '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'b':
+                if (set_printer_backend(optarg) == -1) {
+                    fprintf(stderr, "Unknown printer backend '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                cache_mb = atoll(optarg);
+                break;
+            case 'd':
+                set_print_delay((useconds_t) atoi(optarg));
+                break;
+            case 'e':
+                if (io_engine_select(optarg) == -1) {
+                    fprintf(stderr, "Unknown I/O engine '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'f':
+                config_path = optarg;
+                break;
+            case 'g':
+                grace_period = atoi(optarg);
+                break;
+            case 'i':
+                idle_timeout = atoi(optarg);
+                break;
+            case 'j':
+                journal_path = optarg;
+                break;
+            case 'k':
+                key_path = optarg;
+                break;
+            case 'l':
+                if (parse_limits(optarg, &limits) == -1) {
+                    fprintf(stderr, "Invalid limits '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                device_cache_init(atoi(optarg));
+                break;
+            case 't':
+                pacing_threads = atoi(optarg);
+                break;
+            case 'w':
+                write_stall_timeout = atoi(optarg);
+                break;
+            default:
+                optind = argc + 1;
+        }
+    }
+
+    if (argc - optind != 1) {
+        fprintf(stderr, "Usage: %s [-a role=cpus/...] [-b tty|file:dir|fifo:dir|null] [-c cache_mb] [-d delay_us] [-e sync|uring] [-f class_file] [-g grace_s] [-i idle_s] [-j journal] [-k key_file] [-l limit=n,...] [-m max_devices] [-t pacing_threads] [-w write_stall_s] port\n", argv[0]);
         return 1;   
     }
     
+    // the admin token, only the operator gets to see a made up one
+    if (key_path) {
+        FILE* key = fopen(key_path, "r");
+        unsigned long long token;
+        if (!key || fscanf(key, "%llx", &token) != 1) {
+            fprintf(stderr, "Cannot read an admin token from %s\n", key_path);
+            return 1;
+        }
+        fclose(key);
+        admin_token = token;
+    } else {
+        admin_token = new_token();
+        printf("Admin token %016llx\n", (unsigned long long)admin_token);
+    }
+
+    // printer classes, the default one from the compiled in settings and -d
+    char error[300];
+    base_class.lines_per_page = lines_per_page;
+    base_class.page_price = page_price;
+    base_class.delay_us = get_print_delay();
+    base_class.form_feed_len = sprintf(base_class.form_feed, "\n");
+    printer_config_t* config = load_config(error, sizeof(error));
+    if (!config) {
+        fprintf(stderr, "Invalid printer classes: %s\n", error);
+        return 1;
+    }
+    set_tty_path(config->tty_path);
+    set_print_delay(config->class[0].delay_us);
+    config_install(config);
+
+    file_cache_init(cache_mb * 1024 * 1024);
+
+    // threads that pace the printers, needed before the first job starts;
+    // they submit the printer output queued by the I/O engine before they sleep
+    if (timer_wheel_init(pacing_threads, pacing_tick_us, io_flush) == -1) {
+        perror("Failed to start the timer wheels");
+        return 1;
+    }
+    for (int i = 0; i < pacing_threads; i++)
+        placement_bind(timer_wheel_thread(i), PLACE_SPOOLERS, i);
+
+    // printers whose devices exist are known before the first job,
+    // backends that make devices on demand get their printers on first use
+    discovery = discovery_start(printer_discovered) == 0;
+
+    // resume unfinished jobs of the last run
+    if (journal_path) {
+        if ((journal = journal_open(journal_path)) == NULL) {
+            perror("Failed to open spool journal");
+            return 1;
+        }
+        if (client_count < journal_max_client_id(journal))
+            client_count = journal_max_client_id(journal);
+        // with the journal in place, so what the replayed jobs do is journaled
+        journal_replay(journal, replay_job, NULL);
+    }
+
     // create listening endpoint
-    port = (u_port_t) atoi(argv[1]);
+    port = (u_port_t) atoi(argv[optind]);
+    placement_bind(pthread_self(), PLACE_ACCEPT, 0);
     if ((listenfd = u_open(port)) == -1) {
         perror("Failed to create listening endpoint");
         return 1;
@@ -927,6 +3092,7 @@ int main(int argc, char *argv[]) {
             continue;
         } else {
             pthread_detach(con->tid);
+            placement_bind(con->tid, PLACE_CLIENTS, 0);
         }
         
         print_client_list(&client_list);
@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <pthread.h>
+#include "printer_config.h"
+#include "printer_management.h"
+
+static pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+static printer_config_t *current = NULL;   // Installed configuration
+static unsigned int current_version = 0;   // Its version, read without the mutex
+
+/* a new configuration with only the given default class, NULL if out of memory */
+printer_config_t* config_create(const printer_class_t *defaults) {
+    printer_config_t *config = calloc(1, sizeof(printer_config_t));
+    if(!config)
+        return NULL;
+    config->refs = 1;
+    config->classes = 1;
+    config->class[0] = *defaults;
+    snprintf(config->class[0].name, CONFIG_NAME_LEN, "default");
+    return config;
+}
+
+/* a modifiable copy of a configuration, NULL if out of memory */
+printer_config_t* config_copy(const printer_config_t *config) {
+    printer_config_t *copy = malloc(sizeof(printer_config_t));
+    if(!copy)
+        return NULL;
+    *copy = *config;
+    copy->refs = 1;
+    copy->version = 0;
+    return copy;
+}
+
+/* writes a formatted message to error, returns -1 */
+static int fail(char *error, size_t len, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(error, len, format, args);
+    va_end(args);
+    return -1;
+}
+
+/* parses a non-negative number that must be at least min, 0 or -1 */
+static int parse_number(const char *value, int min, int *result) {
+    char *end;
+    long number = strtol(value, &end, 10);
+    if(end == value || *end || number < min || number > 1000000000)
+        return -1;
+    *result = (int)number;
+    return 0;
+}
+
+/* parses a switch: on/off, yes/no or 1/0; 0 or -1 */
+static int parse_switch(const char *value, int *result) {
+    if(!strcmp(value, "on") || !strcmp(value, "yes") || !strcmp(value, "1"))
+        *result = 1;
+    else if(!strcmp(value, "off") || !strcmp(value, "no") || !strcmp(value, "0"))
+        *result = 0;
+    else
+        return -1;
+    return 0;
+}
+
+/* index of the class with the given name, created as a copy of the */
+/* default class if it is new; -1 if there is no room for it */
+static int find_class(printer_config_t *config, const char *name) {
+    for(int i = 0; i < config->classes; i++) {
+        if(!strcmp(config->class[i].name, name))
+            return i;
+    }
+    if(config->classes == CONFIG_CLASSES)
+        return -1;
+    printer_class_t *class = &config->class[config->classes];
+    *class = config->class[0];
+    snprintf(class->name, CONFIG_NAME_LEN, "%s", name);
+    return config->classes++;
+}
+
+/* assigns the printers of a list like "1-4,7" to a class, 0 or -1 */
+static int assign_printers(printer_config_t *config, int class_index, const char *spec) {
+    const char *p = spec;
+    int ranges = config->ranges;
+    while(*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last;
+        if(end == p || first < 1)
+            return -1;
+        last = first;
+        p = end;
+        if(*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if(end == p + 1 || last < first)
+                return -1;
+            p = end;
+        }
+        if(ranges == CONFIG_RANGES)
+            return -1;
+        config->range[ranges].first = first;
+        config->range[ranges].last = last;
+        config->range[ranges].class_index = class_index;
+        ranges++;
+        if(*p == ',')
+            p++;
+        else if(*p)
+            return -1;
+    }
+    if(ranges == config->ranges)
+        return -1;
+    config->ranges = ranges;
+    return 0;
+}
+
+/* a tty path pattern must take the printer number exactly once */
+static int valid_tty_path(const char *path) {
+    const char *number = strstr(path, "%d");
+    if(!number || strlen(path) >= CONFIG_PATH_LEN)
+        return 0;
+    for(const char *p = path; *p; p++) {
+        if(*p == '%' && p != number)
+            return 0;
+    }
+    return 1;
+}
+
+/* sets a key of a class (created if new), or tty_path if class is NULL; */
+/* 0 or -1 with a message in error */
+int config_set(printer_config_t *config, const char *class_name, const char *key, const char *value,
+               char *error, size_t len) {
+    if(!class_name) {
+        if(strcmp(key, "tty_path"))
+            return fail(error, len, "unknown setting '%s' (classes are set in [class] sections)", key);
+        if(*value && !valid_tty_path(value))
+            return fail(error, len, "tty_path must contain %%d once and no other %%");
+        snprintf(config->tty_path, CONFIG_PATH_LEN, "%s", value);
+        return 0;
+    }
+
+    if(!*class_name || strlen(class_name) >= CONFIG_NAME_LEN)
+        return fail(error, len, "invalid class name '%s'", class_name);
+    int index = find_class(config, class_name);
+    if(index == -1)
+        return fail(error, len, "too many classes (at most %d)", CONFIG_CLASSES);
+    printer_class_t *class = &config->class[index];
+
+    int number;
+    if(!strcmp(key, "lines_per_page")) {
+        if(parse_number(value, 1, &number) == -1)
+            return fail(error, len, "lines_per_page must be at least 1");
+        class->lines_per_page = number;
+    } else if(!strcmp(key, "page_price")) {
+        if(parse_number(value, 0, &number) == -1)
+            return fail(error, len, "page_price must be a number of cents");
+        class->page_price = number;
+    } else if(!strcmp(key, "delay_us")) {
+        if(parse_number(value, 0, &number) == -1)
+            return fail(error, len, "delay_us must be a number of microseconds");
+        class->delay_us = number;
+    } else if(!strcmp(key, "form_feed")) {
+        // Printed as a line of its own; an empty one leaves a blank line
+        if(strlen(value) + 1 >= CONFIG_FORM_FEED)
+            return fail(error, len, "form_feed is longer than %d characters", CONFIG_FORM_FEED - 2);
+        class->form_feed_len = snprintf(class->form_feed, CONFIG_FORM_FEED, "%s\n", value);
+    } else if(!strcmp(key, "banner") || !strcmp(key, "header") || !strcmp(key, "page_numbers")) {
+        if(parse_switch(value, &number) == -1)
+            return fail(error, len, "%s must be on or off", key);
+        if(key[0] == 'b')
+            class->banner = number;
+        else if(key[0] == 'h')
+            class->header = number;
+        else
+            class->page_numbers = number;
+    } else if(!strcmp(key, "printers")) {
+        if(assign_printers(config, index, value) == -1)
+            return fail(error, len, "invalid printer list '%s' (like 1-4,7, at most %d ranges)", value, CONFIG_RANGES);
+    } else {
+        return fail(error, len, "unknown setting '%s'", key);
+    }
+    return 0;
+}
+
+/* strips white space from both ends of s */
+static char* trim(char *s) {
+    while(isspace((unsigned char)*s))
+        s++;
+    char *end = s + strlen(s);
+    while(end > s && isspace((unsigned char)end[-1]))
+        end--;
+    *end = 0;
+    return s;
+}
+
+/*
+   Reads a configuration file into config. The file has lines
+   "key = value"; "[name]" starts the settings of a class, settings
+   before the first class are global. Lines starting with # are comments.
+   Returns 0 or -1 with a message in error.
+*/
+int config_load(printer_config_t *config, const char *path, char *error, size_t len) {
+    FILE *file = fopen(path, "r");
+    if(!file)
+        return fail(error, len, "cannot open %s", path);
+
+    char line[512];
+    char section[CONFIG_NAME_LEN + 1];
+    int in_class = 0;
+    int number = 0;
+    int result = 0;
+    while(!result && fgets(line, sizeof(line), file)) {
+        number++;
+        char *text = trim(line);
+        if(!*text || *text == '#')
+            continue;
+
+        if(*text == '[') {
+            char *end = strchr(text, ']');
+            if(!end || end[1] || end - text - 1 > CONFIG_NAME_LEN - 1) {
+                result = fail(error, len, "%s:%d: malformed section", path, number);
+                break;
+            }
+            *end = 0;
+            snprintf(section, sizeof(section), "%s", trim(text + 1));
+            in_class = 1;
+            continue;
+        }
+
+        char *value = strchr(text, '=');
+        if(!value) {
+            result = fail(error, len, "%s:%d: expected key = value", path, number);
+            break;
+        }
+        *value++ = 0;
+        char message[200];
+        if(config_set(config, in_class ? section : NULL, trim(text), trim(value), message, sizeof(message)) == -1)
+            result = fail(error, len, "%s:%d: %s", path, number, message);
+    }
+    fclose(file);
+    return result;
+}
+
+/* makes config the current configuration, taking over the caller's reference */
+void config_install(printer_config_t *config) {
+    pthread_mutex_lock(&config_mutex);
+    printer_config_t *old = current;
+    config->version = current_version + 1;
+    current = config;
+    __atomic_store_n(&current_version, config->version, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&config_mutex);
+    if(old)
+        config_release(old);
+}
+
+/* the current configuration (one reference) */
+printer_config_t* config_acquire(void) {
+    pthread_mutex_lock(&config_mutex);
+    printer_config_t *config = current;
+    __atomic_add_fetch(&config->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&config_mutex);
+    return config;
+}
+
+/* gives back a reference */
+void config_release(printer_config_t *config) {
+    if(config && __atomic_sub_fetch(&config->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(config);
+}
+
+/* version of the current configuration, cheap enough for every step of a printer */
+unsigned int config_version(void) {
+    return __atomic_load_n(&current_version, __ATOMIC_ACQUIRE);
+}
+
+/* class of a printer */
+const printer_class_t* config_class(const printer_config_t *config, unsigned int printer_no) {
+    for(int i = config->ranges - 1; i >= 0; i--) {
+        const class_range_t *range = &config->range[i];
+        if(printer_no >= range->first && printer_no <= range->last)
+            return &config->class[range->class_index];
+    }
+    return &config->class[0];
+}
+
+/* appends a description of the configuration to buf (at most len bytes) */
+void config_describe(const printer_config_t *config, char *buf, size_t len) {
+    string_appendf(buf, len, "  Configuration %u, tty path %s\n", config->version,
+           config->tty_path[0] ? config->tty_path : "of the backend");
+    for(int i = 0; i < config->classes; i++) {
+        const printer_class_t *class = &config->class[i];
+        string_appendf(buf, len, "  Class %s: %d lines per page, %d cents per page, %u us per character, form feed '%.*s', ",
+               class->name, class->lines_per_page, class->page_price, (unsigned int)class->delay_us,
+               class->form_feed_len - 1, class->form_feed);
+        if(class->banner || class->header || class->page_numbers)
+            string_appendf(buf, len, "%s%s%s", class->banner ? "banner page, " : "", class->header ? "page header, " : "",
+                   class->page_numbers ? "page numbers, " : "");
+        string_appendf(buf, len, "printers ");
+        int listed = 0;
+        for(int r = 0; r < config->ranges; r++) {
+            const class_range_t *range = &config->range[r];
+            if(range->class_index != i)
+                continue;
+            if(range->first == range->last)
+                string_appendf(buf, len, listed ? ",%u" : "%u", range->first);
+            else
+                string_appendf(buf, len, listed ? ",%u-%u" : "%u-%u", range->first, range->last);
+            listed = 1;
+        }
+        if(!i)
+            string_appendf(buf, len, listed ? ", all others" : "all others");
+        else if(!listed)
+            string_appendf(buf, len, "none");
+        string_appendf(buf, len, "\n");
+    }
+}
@@ -0,0 +1,85 @@
+
+/*
+   Printer classes and the configuration that assigns them to printers.
+   A class describes a kind of printer: its page geometry, the price of
+   a page, how fast it prints and what it prints at a page break.
+   A configuration is never changed once installed: a reload or an edit
+   builds a new one that replaces the current one in a single step.
+   Its users hold a reference, so whatever they read stays consistent
+   until they let go of it.
+*/
+
+#ifndef _PRINTER_CONFIG_H_
+#define _PRINTER_CONFIG_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define CONFIG_NAME_LEN     32
+#define CONFIG_FORM_FEED    128
+#define CONFIG_CLASSES      16
+#define CONFIG_RANGES       64
+#define CONFIG_PATH_LEN     256
+
+typedef struct {
+    char        name[CONFIG_NAME_LEN];
+    int         lines_per_page;
+    int         page_price;         // Cents
+    useconds_t  delay_us;           // Per printed character
+    char        form_feed[CONFIG_FORM_FEED]; // Printed at a page break, ends with a newline
+    int         form_feed_len;
+    int         banner;             // 1: a banner page announces every job
+    int         header;             // 1: every page starts with the file and job
+    int         page_numbers;       // 1: every page ends with its number
+} printer_class_t;
+
+/* Printers first to last belong to a class */
+typedef struct {
+    unsigned int    first;
+    unsigned int    last;
+    int             class_index;
+} class_range_t;
+
+typedef struct {
+    int             refs;           // Holders of the configuration
+    unsigned int    version;        // Increases with every installed configuration
+    char            tty_path[CONFIG_PATH_LEN]; // Pattern of the tty backend, "" for its default
+    int             classes;        // Class 0 is "default", the class of unassigned printers
+    printer_class_t class[CONFIG_CLASSES];
+    int             ranges;         // Later ranges take precedence
+    class_range_t   range[CONFIG_RANGES];
+} printer_config_t;
+
+/* a new configuration with only the given default class, NULL if out of memory */
+printer_config_t* config_create(const printer_class_t *defaults);
+
+/* a modifiable copy of a configuration, NULL if out of memory */
+printer_config_t* config_copy(const printer_config_t *config);
+
+/* reads a configuration file into config, 0 or -1 with a message in error */
+int config_load(printer_config_t *config, const char *path, char *error, size_t len);
+
+/* sets a key of a class (created if new), or tty_path if class is NULL; */
+/* 0 or -1 with a message in error */
+int config_set(printer_config_t *config, const char *class_name, const char *key, const char *value,
+               char *error, size_t len);
+
+/* makes config the current configuration, taking over the caller's reference */
+void config_install(printer_config_t *config);
+
+/* the current configuration (one reference) */
+printer_config_t* config_acquire(void);
+
+/* gives back a reference */
+void config_release(printer_config_t *config);
+
+/* version of the current configuration, cheap enough for every step of a printer */
+unsigned int config_version(void);
+
+/* class of a printer */
+const printer_class_t* config_class(const printer_config_t *config, unsigned int printer_no);
+
+/* appends a description of the configuration to buf (at most len bytes) */
+void config_describe(const printer_config_t *config, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include "printer_management.h"
+#include "printer_discovery.h"
+
+static discovery_fn_t report;               // Told about every change
+static pthread_mutex_t pattern_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char pattern[PATH_MAX];              // Device pattern being watched (guarded by pattern_mutex)
+static char dir[PATH_MAX];                  // Its directory
+static char prefix[NAME_MAX + 1];           // Device names: prefix, number, suffix
+static char suffix[NAME_MAX + 1];
+static unsigned char present[DISCOVERY_MAX_PRINTER + 1]; // Printers with a device, as last reported
+static int wake_pipe[2];                    // A byte requests a rescan
+#ifdef __linux__
+static int inotify_fd = -1;
+static int watch = -1;
+#endif
+
+/* takes the backend's device pattern apart, 0 or -1 if it has none */
+static int read_pattern(void) {
+    char path[PATH_MAX];
+    if(printer_device_pattern(path, sizeof(path)) == -1)
+        return -1;
+    char *slash = strrchr(path, '/');
+    char *number = strstr(slash ? slash : path, "%d");
+    if(!number)
+        return -1;
+
+    pthread_mutex_lock(&pattern_mutex);
+    snprintf(pattern, sizeof(pattern), "%s", path);
+    pthread_mutex_unlock(&pattern_mutex);
+    if(slash) {
+        *slash = 0;
+        snprintf(dir, sizeof(dir), "%s", slash == path ? "/" : path);
+    } else {
+        snprintf(dir, sizeof(dir), ".");
+    }
+    const char *name = slash ? slash + 1 : path;
+    snprintf(prefix, sizeof(prefix), "%.*s", (int)(number - name), name);
+    snprintf(suffix, sizeof(suffix), "%s", number + 2);
+    return 0;
+}
+
+/* printer number of a device name, 0 if the name is no device */
+static unsigned int printer_of(const char *name) {
+    size_t len = strlen(prefix);
+    if(strncmp(name, prefix, len) || name[len] < '0' || name[len] > '9')
+        return 0;
+    char *end;
+    unsigned long no = strtoul(name + len, &end, 10);
+    if(strcmp(end, suffix) || no > DISCOVERY_MAX_PRINTER)
+        return 0;
+    return (unsigned int)no;
+}
+
+/* reports a printer whose device may have changed */
+static void check(unsigned int no) {
+    int exists = printer_exists(no);
+    if(exists != present[no]) {
+        present[no] = exists;
+        report(no, exists);
+    }
+}
+
+/* enumerates the directory, reports what changed since the last time */
+static void enumerate(void) {
+    static unsigned char seen[DISCOVERY_MAX_PRINTER + 1];
+    memset(seen, 0, sizeof(seen));
+    DIR *d = opendir(dir);
+    if(d) {
+        struct dirent *entry;
+        while((entry = readdir(d))) {
+            unsigned int no = printer_of(entry->d_name);
+            if(no)
+                seen[no] = printer_exists(no);
+        }
+        closedir(d);
+    }
+    for(unsigned int no = 1; no <= DISCOVERY_MAX_PRINTER; no++) {
+        if(seen[no] != present[no]) {
+            present[no] = seen[no];
+            report(no, seen[no]);
+        }
+    }
+}
+
+#ifdef __linux__
+/* (re)starts watching the directory */
+static void watch_dir(void) {
+    if(watch != -1)
+        inotify_rm_watch(inotify_fd, watch);
+    watch = inotify_add_watch(inotify_fd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB);
+    if(watch == -1)
+        perror("discovery: cannot watch the printer devices");
+}
+
+/* reports the devices named by the queued inotify events */
+static void read_events(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for(char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct inotify_event *event = (struct inotify_event*)p;
+            if(event->mask & IN_Q_OVERFLOW) {
+                enumerate();
+            } else if(event->len) {
+                unsigned int no = printer_of(event->name);
+                if(no)
+                    check(no);
+            }
+        }
+    }
+}
+#endif
+
+/* watches for changes, rescans on request */
+static void* discovery_thread(void *arg) {
+    struct pollfd fds[2] = { { wake_pipe[0], POLLIN, 0 }, { -1, POLLIN, 0 } };
+#ifdef __linux__
+    fds[1].fd = inotify_fd;
+    int timeout = -1;
+#else
+    int timeout = 1000;
+#endif
+
+    while(1) {
+        if(poll(fds, 2, timeout) == -1)
+            continue;
+        if(fds[0].revents & POLLIN) {
+            char byte;
+            while(read(wake_pipe[0], &byte, 1) == 1)
+                ;
+            if(read_pattern() == 0) {
+#ifdef __linux__
+                watch_dir();
+#endif
+                enumerate();
+            }
+            continue;
+        }
+#ifdef __linux__
+        if(fds[1].revents & POLLIN)
+            read_events();
+#else
+        enumerate();
+#endif
+    }
+    return NULL;
+}
+
+/* enumerates the devices, reporting each one to fn, and starts watching; */
+/* 0, or -1 if the backend has nothing to discover or watching failed */
+int discovery_start(discovery_fn_t fn) {
+    pthread_t tid;
+
+    if(read_pattern() == -1)
+        return -1;
+    report = fn;
+    if(pipe(wake_pipe) == -1)
+        return -1;
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+#ifdef __linux__
+    // Watch before enumerating, so no device slips through in between
+    if((inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+        return -1;
+    watch_dir();
+#endif
+    enumerate();
+    if(pthread_create(&tid, NULL, discovery_thread, NULL))
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+/* enumerates again with the backend's current device pattern */
+void discovery_rescan(void) {
+    if(write(wake_pipe[1], "", 1) == -1)
+        perror("discovery: cannot request a rescan");
+}
+
+/* writes the device pattern being watched to buf (at most len bytes) */
+void discovery_describe(char *buf, size_t len) {
+    pthread_mutex_lock(&pattern_mutex);
+    snprintf(buf, len, "%s", pattern);
+    pthread_mutex_unlock(&pattern_mutex);
+}
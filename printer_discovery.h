@@ -0,0 +1,33 @@
+
+/*
+   Discovery of printers. The directory of the backend's devices is
+   enumerated at startup and then watched with inotify (on other systems
+   enumerated again every second), so printers are registered as their
+   devices appear and retired as they vanish. Job submission only looks
+   up printers that are known already, it never probes a device.
+   Backends that make their devices on demand have nothing to discover.
+*/
+
+#ifndef _PRINTER_DISCOVERY_H_
+#define _PRINTER_DISCOVERY_H_
+
+#include <stddef.h>
+
+/* Highest printer number that is discovered */
+#define DISCOVERY_MAX_PRINTER   65535
+
+/* called on the discovery thread (at startup on the caller's) when */
+/* a printer's device appears (present 1) or vanishes (present 0) */
+typedef void (*discovery_fn_t)(unsigned int printer_no, int present);
+
+/* enumerates the devices, reporting each one to fn, and starts watching; */
+/* 0, or -1 if the backend has nothing to discover or watching failed */
+int discovery_start(discovery_fn_t fn);
+
+/* enumerates again with the backend's current device pattern */
+void discovery_rescan(void);
+
+/* writes the device pattern being watched to buf (at most len bytes) */
+void discovery_describe(char *buf, size_t len);
+
+#endif
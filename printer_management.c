@@ -17,10 +17,22 @@
  * 1.1 / 23. Aug 06 (rm)
  * 1.2 / 04. Aug 17 (tm)
  * - Added flag for switching tty paths to make it work under OS X
+ * 1.3 / 18. Oct 26 (tm)
+ * - Printer backends (tty, file, fifo, null), configurable delay
+ * 1.4 / 18. Oct 26 (tm)
+ * - print_text: unpaced output for callers that pace themselves
+ * - Writes to devices go through the I/O engine (may be batched)
+ * 1.5 / 18. Oct 26 (tm)
+ * - tty path pattern can be set at runtime
+ * - Device path patterns of the backends, for printer discovery
+ * 1.6 / 18. Oct 26 (tm)
+ * - print_char removed, printers are paced by the print server
+ * - string_appendf: formatted append into a fixed-size buffer
  * ===========================================================================
  */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <time.h>
 #include <string.h>
 #include <stdlib.h>
@@ -29,68 +41,267 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include "io_engine.h"
 #include "printer_management.h"
 
 #ifdef OSX
-char tty_path[] = "/dev/ttys00%d";
+static const char default_tty_path[] = "/dev/ttys00%d";
 #else
-char tty_path[] = "/dev/pts/%d";
+static const char default_tty_path[] = "/dev/pts/%d";
 #endif
 
-/* returns 1 (exists) or 0 (does not exist) */
-int
-printer_exists(unsigned int printer_no)
+/* pattern of the tty devices; replaced patterns are never freed, */
+/* as printers may still be opening their device with them */
+static const char *tty_path = default_tty_path;
+
+/* directory for the file and fifo backends */
+static char backend_dir[PATH_MAX - 32] = ".";
+
+/* delay per printed character, very slow printer by default */
+static useconds_t print_delay = 100000;
+
+
+/* tty backend: character devices given by tty_path */
+
+static int
+tty_health(unsigned int printer_no)
 {
   char filename[MAX_CANON];
   struct stat statbuf;
 
-  sprintf(filename, tty_path, printer_no);
+  sprintf(filename, __atomic_load_n(&tty_path, __ATOMIC_ACQUIRE), printer_no);
   if (stat(filename, &statbuf) == -1)
     return 0;
   return S_ISCHR(statbuf.st_mode);
 }
 
-/* returns a file id or -1 */
-int
-open_printer(unsigned int printer_no)
+static int
+tty_open(printer_dev_t *dev)
 {
   char filename[MAX_CANON];
 
+  sprintf(filename, __atomic_load_n(&tty_path, __ATOMIC_ACQUIRE), dev->printer_no);
+  dev->fd = open(filename, O_WRONLY | O_NOCTTY);
+  return dev->fd == -1 ? -1 : 0;
+}
+
+static int
+tty_pattern(char *buf, size_t len)
+{
+  snprintf(buf, len, "%s", __atomic_load_n(&tty_path, __ATOMIC_ACQUIRE));
+  return 0;
+}
+
+static ssize_t
+fd_write(printer_dev_t *dev, const char *buf, size_t len)
+{
+  return io_write(dev->fd, buf, len);
+}
+
+static int
+fd_close(printer_dev_t *dev)
+{
+  int res = close(dev->fd);
+  dev->fd = -1;
+  return res;
+}
+
+/* file backend: regular files DIR/printerN.out, created on demand */
+
+static int
+file_health(unsigned int printer_no)
+{
+  struct stat statbuf;
+
+  if (stat(backend_dir, &statbuf) == -1)
+    return 0;
+  return S_ISDIR(statbuf.st_mode);
+}
+
+static int
+file_open(printer_dev_t *dev)
+{
+  char filename[PATH_MAX];
+
+  snprintf(filename, PATH_MAX, "%s/printer%u.out", backend_dir, dev->printer_no);
+  dev->fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  return dev->fd == -1 ? -1 : 0;
+}
+
+/* fifo backend: existing named pipes DIR/printerN.fifo */
+
+static int
+fifo_health(unsigned int printer_no)
+{
+  char filename[PATH_MAX];
+  struct stat statbuf;
+
+  snprintf(filename, PATH_MAX, "%s/printer%u.fifo", backend_dir, printer_no);
+  if (stat(filename, &statbuf) == -1)
+    return 0;
+  return S_ISFIFO(statbuf.st_mode);
+}
+
+static int
+fifo_pattern(char *buf, size_t len)
+{
+  snprintf(buf, len, "%s/printer%%d.fifo", backend_dir);
+  return 0;
+}
+
+static int
+fifo_open(printer_dev_t *dev)
+{
+  char filename[PATH_MAX];
+  int flags;
+
+  /* non-blocking open fails with ENXIO instead of hanging without reader */
+  snprintf(filename, PATH_MAX, "%s/printer%u.fifo", backend_dir, dev->printer_no);
+  dev->fd = open(filename, O_WRONLY | O_NONBLOCK);
+  if (dev->fd == -1)
+    return -1;
+  flags = fcntl(dev->fd, F_GETFL);
+  fcntl(dev->fd, F_SETFL, flags & ~O_NONBLOCK);
+  return 0;
+}
+
+/* null backend: discards everything, only counts bytes */
+
+static int
+null_health(unsigned int printer_no)
+{
+  return 1;
+}
+
+static int
+null_open(printer_dev_t *dev)
+{
+  dev->fd = -1;
+  return 0;
+}
+
+static ssize_t
+null_write(printer_dev_t *dev, const char *buf, size_t len)
+{
+  return len;
+}
+
+static int
+null_close(printer_dev_t *dev)
+{
+  return 0;
+}
+
+/* file and null backend: any printer number is a printer */
+
+static int
+no_pattern(char *buf, size_t len)
+{
+  return -1;
+}
+
+static const printer_backend_t backends[] = {
+  { "tty",  tty_open,  fd_write,   fd_close,   tty_health,  tty_pattern  },
+  { "file", file_open, fd_write,   fd_close,   file_health, no_pattern   },
+  { "fifo", fifo_open, fd_write,   fd_close,   fifo_health, fifo_pattern },
+  { "null", null_open, null_write, null_close, null_health, no_pattern   },
+};
+
+static const printer_backend_t *backend = &backends[0];
+
+/* returns 0 (success) or -1 (unknown backend) */
+int
+set_printer_backend(const char *spec)
+{
+  const char *dir = strchr(spec, ':');
+  size_t len = dir ? (size_t)(dir - spec) : strlen(spec);
+  int i;
+
+  for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    if (strlen(backends[i].name) == len && !strncmp(spec, backends[i].name, len)) {
+      backend = &backends[i];
+      if (dir)
+        snprintf(backend_dir, sizeof(backend_dir), "%s", dir + 1);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const char*
+printer_backend_name(void)
+{
+  return backend->name;
+}
+
+void
+set_print_delay(useconds_t usec)
+{
+  print_delay = usec;
+}
+
+useconds_t
+get_print_delay(void)
+{
+  return print_delay;
+}
+
+void
+set_tty_path(const char *pattern)
+{
+  const char *path = pattern && *pattern ? strdup(pattern) : default_tty_path;
+
+  __atomic_store_n(&tty_path, path, __ATOMIC_RELEASE);
+}
+
+/* returns 0 or -1 (devices are made on demand, nothing to discover) */
+int
+printer_device_pattern(char *buf, size_t len)
+{
+  return backend->pattern(buf, len);
+}
+
+/* returns 1 (exists) or 0 (does not exist) */
+int
+printer_exists(unsigned int printer_no)
+{
+  return backend->health(printer_no);
+}
+
+/* returns 0 (success) or -1 */
+int
+open_printer(printer_dev_t *dev, unsigned int printer_no)
+{
+  dev->backend = backend;
+  dev->printer_no = printer_no;
+  dev->fd = -1;
+  dev->bytes_written = 0;
   if (!printer_exists(printer_no))
     return -1;
-  sprintf(filename, tty_path, printer_no);
-  return open(filename, O_WRONLY);
+  return backend->open(dev);
 }
 
 /* close */
 int
-close_printer(int prt_fd)
+close_printer(printer_dev_t *dev)
 {
-  return(close(prt_fd));
+  return dev->backend->close(dev);
 }
 
+/* prints len characters without delay, pacing is up to the caller */
 /* returns 1 (success) or negative error code (no success) */
 int
-print_char(int prt_fd, char c)
+print_text(printer_dev_t *dev, const char *buf, size_t len)
 {
-  int res, i;
+  const printer_backend_t *b = dev->backend;
+  ssize_t res;
 
-  if (c == '\f') {
-    /* form feed: write dashed line */
-    for (i = 0; i < 30; i++) {
-      res = write(prt_fd, "- ", 2);
-      if (res != 2) return -1;
-    }
-    res = write(prt_fd, "\n", 1);
-    if (res != 1) return -1;
-  }
-  else {
-    /* any other character */
-    res = write(prt_fd, &c, 1);
-    if (res != 1) return -1;
+  while (len > 0) {
+    if ((res = b->write(dev, buf, len)) <= 0) return -1;
+    dev->bytes_written += res;
+    buf += res;
+    len -= res;
   }
-  /* very slow printer */
-  usleep(100000);
   return 1;
 }
 
@@ -115,4 +326,16 @@ string_append(char *base, char *extension)
   return base;
 }
 
+/* appends formatted text to buf, truncating at len bytes */
+void
+string_appendf(char *buf, size_t len, const char *format, ...)
+{
+  size_t used = strlen(buf);
+  va_list args;
 
+  if (used + 1 >= len)
+    return;
+  va_start(args, format);
+  vsnprintf(buf + used, len - used, format, args);
+  va_end(args);
+}
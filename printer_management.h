@@ -23,19 +23,72 @@
 #ifndef _PRINTER_MANAGEMENT_H_
 #define _PRINTER_MANAGEMENT_H_
 
+#include <sys/types.h>
+
+typedef struct printer_dev printer_dev_t;
+
+/*
+   A printer backend: how printer numbers map to devices and how
+   characters reach them. Selected once at startup.
+*/
+typedef struct {
+    const char* name;                                              // "tty", "file", "fifo", "null"
+    int       (*open)(printer_dev_t* dev);                         // 0 or -1
+    ssize_t   (*write)(printer_dev_t* dev, const char* buf, size_t len);
+    int       (*close)(printer_dev_t* dev);                        // 0 or -1
+    int       (*health)(unsigned int printer_no);                  // 1 (usable) or 0
+    int       (*pattern)(char* buf, size_t len);                   // Device path with %d, -1 if made on demand
+} printer_backend_t;
+
+/* An opened printer */
+struct printer_dev {
+    const printer_backend_t* backend;
+    unsigned int    printer_no;
+    int             fd;             // -1 for backends without a file descriptor
+    unsigned long   bytes_written;  // Counted for every backend
+};
+
+/* selects the backend: "tty", "file:DIR", "fifo:DIR" or "null"; returns 0 or -1 */
+extern int
+set_printer_backend(const char *spec);
+
+extern const char*
+printer_backend_name(void);
+
+/* sets the per-character delay of the simulated printers */
+extern void
+set_print_delay(useconds_t usec);
+
+extern useconds_t
+get_print_delay(void);
+
+/* sets the device pattern of the tty backend (with %d for the printer */
+/* number), NULL or "" for the default */
+extern void
+set_tty_path(const char *pattern);
+
+/* writes the path pattern of the backend's devices (%d for the printer */
+/* number) to buf; returns 0 or -1 if the backend makes devices on demand */
+extern int
+printer_device_pattern(char *buf, size_t len);
+
 extern int
 printer_exists(unsigned int printer_no);
 
 extern int
-open_printer(unsigned int printer_no);
+open_printer(printer_dev_t *dev, unsigned int printer_no);
 
 extern int
-close_printer(int prt_fd);
+close_printer(printer_dev_t *dev);
 
+/* prints len characters without the print delay */
 extern int
-print_char(int prt_fd, char c);
+print_text(printer_dev_t *dev, const char *buf, size_t len);
 
 extern char*
 string_append(char *base, char *extension);
 
+extern void
+string_appendf(char *buf, size_t len, const char *format, ...);
+
 #endif
@@ -0,0 +1,408 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "dbllinklist.h"
+#include "spool_journal.h"
+
+/* The file grows by this many records */
+#define JOURNAL_GROW_RECORDS 4096
+
+/* Hash buckets for the unfinished jobs */
+#define JOURNAL_BUCKETS 1024
+
+/* Time the flusher collects records before it syncs them */
+static const int commit_interval_ms = 20;
+
+/* Compact when there are more records than this ... */
+static const uint64_t compact_min_records = 4096;
+
+/* ... and this many times more records than unfinished jobs */
+static const uint64_t compact_factor = 4;
+
+/* An unfinished job as known to the journal */
+typedef struct {
+    list_head_t         order_elem;  // Pointers into the list of unfinished jobs (submission order)
+    list_head_t         bucket_elem; // Pointers into the hash bucket
+    journal_record_t    state;       // Latest state, event is JOURNAL_SUBMITTED
+} live_job_t;
+
+struct journal {
+    char                path[PATH_MAX];
+    int                 fd;
+    journal_record_t*   records;    // The mapped file
+    uint64_t            capacity;   // Records that fit into the mapping
+    uint64_t            count;      // Records written
+    uint64_t            synced;     // Records known to be on disk
+    uint64_t            compacted;  // Records dropped by compactions: compacted + seq numbers
+                                    // the records of all files in the order they were appended
+    list_head_t         live;       // Unfinished jobs in submission order
+    list_head_t         buckets[JOURNAL_BUCKETS];
+    uint64_t            live_count; // Number of unfinished jobs
+    int                 max_client_id;
+    pthread_mutex_t     mutex;      // Guards everything but the mapping itself
+    pthread_cond_t      flush_cond; // Wakes up the flusher
+    pthread_cond_t      synced_cond;// Broadcast after each group commit
+    pthread_rwlock_t    map_rw;     // Held for reading while syncing, for writing while remapping
+    pthread_t           flusher;
+    int                 stop;
+};
+
+
+static uint32_t record_checksum(const journal_record_t *record) {
+    const unsigned char *p = (const unsigned char*)record + sizeof(record->checksum);
+    const unsigned char *end = (const unsigned char*)record + sizeof(journal_record_t);
+    uint32_t hash = 2166136261u;
+    while(p < end) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int record_valid(const journal_record_t *record, uint64_t seq) {
+    return record->seq == seq
+        && record->event >= JOURNAL_SUBMITTED && record->event <= JOURNAL_INVOICED
+        && record->checksum == record_checksum(record);
+}
+
+static list_head_t* bucket(journal_t *journal, int client_id, int job_id, int sub_id) {
+    unsigned int hash = ((unsigned int)client_id * 2654435761u ^ (unsigned int)job_id) * 31u + (unsigned int)sub_id;
+    return &journal->buckets[hash % JOURNAL_BUCKETS];
+}
+
+static live_job_t* live_find(journal_t *journal, int client_id, int job_id, int sub_id) {
+    list_head_t *head = bucket(journal, client_id, job_id, sub_id);
+    for(list_head_t *ptr = head->next; ptr != head; ptr = ptr->next) {
+        live_job_t *live = (live_job_t*)((char*)ptr - offsetof(live_job_t, bucket_elem));
+        if(live->state.client_id == client_id && live->state.job_id == job_id && live->state.sub_id == sub_id)
+            return live;
+    }
+    return NULL;
+}
+
+/* updates the unfinished jobs with a record */
+static void live_apply(journal_t *journal, const journal_record_t *record) {
+    live_job_t *live = live_find(journal, record->client_id, record->job_id, record->sub_id);
+
+    if(record->client_id > journal->max_client_id)
+        journal->max_client_id = record->client_id;
+
+    switch(record->event) {
+        case JOURNAL_SUBMITTED:
+            if(!live) {
+                live = malloc(sizeof(live_job_t));
+                list_init(&live->order_elem);
+                list_init(&live->bucket_elem);
+                list_add_tail(&live->order_elem, &journal->live);
+                list_add(&live->bucket_elem, bucket(journal, record->client_id, record->job_id, record->sub_id));
+                journal->live_count++;
+            }
+            live->state = *record;
+            break;
+        case JOURNAL_STARTED:
+        case JOURNAL_PROGRESS:
+            if(live) {
+                live->state.status = record->status;
+                live->state.page_count = record->page_count;
+                live->state.offset = record->offset;
+            }
+            break;
+        default:
+            if(live) {
+                list_del(&live->order_elem);
+                list_del(&live->bucket_elem);
+                free(live);
+                journal->live_count--;
+            }
+    }
+}
+
+/* maps the file with the given capacity (in records), 0 or -1 */
+static int journal_map(journal_t *journal, int fd, uint64_t capacity) {
+    size_t size = capacity * sizeof(journal_record_t);
+    struct stat statbuf;
+
+    if(fstat(fd, &statbuf) == -1)
+        return -1;
+    if(statbuf.st_size < size && ftruncate(fd, size) == -1)
+        return -1;
+    void *records = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(records == MAP_FAILED)
+        return -1;
+    journal->fd = fd;
+    journal->records = records;
+    journal->capacity = capacity;
+    return 0;
+}
+
+static void journal_unmap(journal_t *journal) {
+    munmap(journal->records, journal->capacity * sizeof(journal_record_t));
+    journal->records = NULL;
+}
+
+/* makes room for more records, caller holds the mutex. 0 or -1 */
+static int journal_grow(journal_t *journal) {
+    uint64_t capacity = journal->capacity;
+    int res;
+
+    pthread_rwlock_wrlock(&journal->map_rw);
+    journal_unmap(journal);
+    res = journal_map(journal, journal->fd, 2 * capacity);
+    if(res == -1 && journal_map(journal, journal->fd, capacity) == -1) {
+        // Without a mapping nothing can be appended anymore
+        journal->capacity = 0;
+    }
+    pthread_rwlock_unlock(&journal->map_rw);
+    return res;
+}
+
+/* appends a copy of a record to a file being built, renumbered. 0 or -1 if it is full */
+static int copy_record(journal_t *fresh, uint64_t *seq, const journal_record_t *from) {
+    if(*seq >= fresh->capacity)
+        return -1;
+    journal_record_t *record = &fresh->records[*seq];
+    *record = *from;
+    record->seq = ++*seq;
+    record->checksum = record_checksum(record);
+    return 0;
+}
+
+/*
+   Rewrites the journal with one record per unfinished job
+   and replaces the old file. Caller holds the mutex, which is
+   released while the new file is synced: records appended
+   meanwhile are carried over to the new file afterwards.
+*/
+static void journal_compact(journal_t *journal) {
+    char tmp_path[PATH_MAX + 8];
+    journal_t fresh;
+    uint64_t seq = 0;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", journal->path);
+    uint64_t capacity = JOURNAL_GROW_RECORDS;
+    while(capacity < 2 * journal->live_count)
+        capacity *= 2;
+    pthread_mutex_unlock(&journal->mutex);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd != -1 && journal_map(&fresh, fd, capacity) == -1) {
+        close(fd);
+        unlink(tmp_path);
+        fd = -1;
+    }
+    pthread_mutex_lock(&journal->mutex);
+    if(fd == -1)
+        return;
+
+    // The unfinished jobs as of now, the records up to here are not needed anymore
+    uint64_t snapshot = journal->count;
+    for(list_head_t *ptr = journal->live.next; ptr != &journal->live; ptr = ptr->next) {
+        live_job_t *live = (live_job_t*)ptr;
+        copy_record(&fresh, &seq, &live->state);
+        fresh.records[seq - 1].event = JOURNAL_SUBMITTED;
+        fresh.records[seq - 1].checksum = record_checksum(&fresh.records[seq - 1]);
+    }
+    uint64_t live_records = seq;
+
+    // Syncing takes a while, appending goes on meanwhile
+    pthread_mutex_unlock(&journal->mutex);
+    int res = msync(fresh.records, capacity * sizeof(journal_record_t), MS_SYNC) == -1 || fsync(fd) == -1 ? -1 : 0;
+    pthread_mutex_lock(&journal->mutex);
+
+    if(!journal->records)
+        res = -1;
+    for(uint64_t i = snapshot; res == 0 && i < journal->count; i++)
+        res = copy_record(&fresh, &seq, &journal->records[i]);
+    if(res == -1 || rename(tmp_path, journal->path) == -1) {
+        journal_unmap(&fresh);
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&journal->map_rw);
+    journal_unmap(journal);
+    close(journal->fd);
+    journal->fd = fd;
+    journal->records = fresh.records;
+    journal->capacity = fresh.capacity;
+    // The records carried over are synced with the next group commit
+    journal->compacted += snapshot - live_records;
+    journal->count = seq;
+    journal->synced = live_records;
+    pthread_rwlock_unlock(&journal->map_rw);
+    // Records up to the snapshot are on disk with the new file
+    pthread_cond_broadcast(&journal->synced_cond);
+    printf("journal: compacted to %llu records\n", (unsigned long long)seq);
+}
+
+/*
+   Flusher thread: syncs all records written since the last round
+   at once (group commit) and compacts the journal from time to time.
+*/
+static void* journal_flusher(void *arg) {
+    journal_t *journal = (journal_t*)arg;
+    long page = sysconf(_SC_PAGESIZE);
+
+    pthread_mutex_lock(&journal->mutex);
+    while(!journal->stop || journal->synced < journal->count) {
+        if(journal->synced == journal->count && !journal->stop) {
+            struct timeval now;
+            struct timespec until;
+            gettimeofday(&now, NULL);
+            long long nsec = (long long)now.tv_usec * 1000 + (long long)commit_interval_ms * 1000000;
+            until.tv_sec = now.tv_sec + nsec / 1000000000;
+            until.tv_nsec = nsec % 1000000000;
+            pthread_cond_timedwait(&journal->flush_cond, &journal->mutex, &until);
+            continue;
+        }
+
+        // Sync everything written until now, appending goes on meanwhile
+        uint64_t from = journal->synced;
+        uint64_t to = journal->count;
+        pthread_rwlock_rdlock(&journal->map_rw);
+        pthread_mutex_unlock(&journal->mutex);
+        size_t start = (from * sizeof(journal_record_t)) & ~(page - 1);
+        size_t end = to * sizeof(journal_record_t);
+        if(msync((char*)journal->records + start, end - start, MS_SYNC) == -1)
+            perror("journal: msync failed");
+        pthread_rwlock_unlock(&journal->map_rw);
+        pthread_mutex_lock(&journal->mutex);
+
+        if(journal->synced < to)
+            journal->synced = to;
+        pthread_cond_broadcast(&journal->synced_cond);
+
+        if(!journal->stop && journal->count > compact_min_records
+           && journal->count > compact_factor * journal->live_count)
+            journal_compact(journal);
+    }
+    pthread_cond_broadcast(&journal->synced_cond);
+    pthread_mutex_unlock(&journal->mutex);
+    return NULL;
+}
+
+/* opens (or creates) the journal and reads it, returns NULL on error */
+journal_t* journal_open(const char *path) {
+    journal_t *journal = calloc(1, sizeof(journal_t));
+    struct stat statbuf;
+
+    snprintf(journal->path, PATH_MAX, "%s", path);
+    list_init(&journal->live);
+    for(int i = 0; i < JOURNAL_BUCKETS; i++)
+        list_init(&journal->buckets[i]);
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd == -1 || fstat(fd, &statbuf) == -1) {
+        free(journal);
+        return NULL;
+    }
+    uint64_t capacity = JOURNAL_GROW_RECORDS;
+    while(capacity * sizeof(journal_record_t) < statbuf.st_size)
+        capacity *= 2;
+    if(journal_map(journal, fd, capacity) == -1) {
+        close(fd);
+        free(journal);
+        return NULL;
+    }
+
+    // Replay up to the first record that is not complete
+    uint64_t count = 0;
+    while(count < capacity && record_valid(&journal->records[count], count + 1)) {
+        live_apply(journal, &journal->records[count]);
+        count++;
+    }
+    // Whatever follows is garbage of a crash, later records must not mix with it
+    memset(&journal->records[count], 0, (capacity - count) * sizeof(journal_record_t));
+    msync(journal->records, capacity * sizeof(journal_record_t), MS_SYNC);
+    journal->count = count;
+    journal->synced = count;
+    printf("journal: replayed %llu records, %llu unfinished jobs\n",
+           (unsigned long long)count, (unsigned long long)journal->live_count);
+
+    pthread_mutex_init(&journal->mutex, NULL);
+    pthread_cond_init(&journal->flush_cond, NULL);
+    pthread_cond_init(&journal->synced_cond, NULL);
+    pthread_rwlock_init(&journal->map_rw, NULL);
+    if(pthread_create(&journal->flusher, NULL, journal_flusher, journal)) {
+        journal_unmap(journal);
+        close(fd);
+        free(journal);
+        return NULL;
+    }
+    return journal;
+}
+
+/* hands the unfinished jobs found by journal_open to replay, which may append to the journal */
+void journal_replay(journal_t *journal, journal_replay_fn replay, void *arg) {
+    // The jobs as read, replaying them changes the list
+    pthread_mutex_lock(&journal->mutex);
+    uint64_t count = journal->live_count;
+    journal_record_t *states = malloc((count ? count : 1) * sizeof(journal_record_t));
+    uint64_t i = 0;
+    for(list_head_t *ptr = journal->live.next; ptr != &journal->live; ptr = ptr->next)
+        states[i++] = ((live_job_t*)ptr)->state;
+    pthread_mutex_unlock(&journal->mutex);
+
+    for(i = 0; i < count; i++)
+        replay(&states[i], arg);
+    free(states);
+}
+
+/* appends a record; with durable != 0 returns only after it is on disk. 0 or -1 */
+int journal_append(journal_t *journal, journal_record_t *record, int durable) {
+    if(!journal)
+        return 0;
+
+    pthread_mutex_lock(&journal->mutex);
+    if(journal->count >= journal->capacity && (!journal->records || journal_grow(journal) == -1)) {
+        pthread_mutex_unlock(&journal->mutex);
+        return -1;
+    }
+    record->seq = journal->count + 1;
+    record->checksum = record_checksum(record);
+    journal->records[journal->count++] = *record;
+    live_apply(journal, record);
+
+    if(durable) {
+        // Compacting renumbers the records, their order stays
+        uint64_t position = journal->compacted + record->seq;
+        pthread_cond_signal(&journal->flush_cond);
+        while(journal->compacted + journal->synced < position && !journal->stop)
+            pthread_cond_wait(&journal->synced_cond, &journal->mutex);
+    }
+    pthread_mutex_unlock(&journal->mutex);
+    return 0;
+}
+
+/* highest client id found in the journal */
+int journal_max_client_id(journal_t *journal) {
+    return journal ? journal->max_client_id : 0;
+}
+
+/* syncs outstanding records, stops the flusher and closes the journal */
+void journal_close(journal_t *journal) {
+    if(!journal)
+        return;
+    pthread_mutex_lock(&journal->mutex);
+    journal->stop = 1;
+    pthread_cond_signal(&journal->flush_cond);
+    pthread_mutex_unlock(&journal->mutex);
+    pthread_join(journal->flusher, NULL);
+
+    journal_unmap(journal);
+    close(journal->fd);
+    while(!list_empty(&journal->live)) {
+        live_job_t *live = (live_job_t*)list_del(journal->live.next);
+        free(live);
+    }
+    free(journal);
+}
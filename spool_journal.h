@@ -0,0 +1,60 @@
+
+/*
+   Append-only journal of the job lifecycle.
+   Records have a fixed size and are written to a memory mapped file.
+   A flusher thread syncs them in groups; on startup the journal is
+   replayed so that unfinished jobs can be resumed, and it is rewritten
+   with only the unfinished jobs when it has grown too large.
+*/
+
+#ifndef _SPOOL_JOURNAL_H_
+#define _SPOOL_JOURNAL_H_
+
+#include <stdint.h>
+
+typedef enum {
+    JOURNAL_SUBMITTED = 1,  // Job was created
+    JOURNAL_STARTED,        // Job got its printer
+    JOURNAL_PROGRESS,       // Job finished a page
+    JOURNAL_FINISHED,       // Job is done, canceled or failed
+    JOURNAL_INVOICED        // Job was invoiced or dropped, forget it
+} journal_event_e;
+
+/* One record. For unfinished jobs also the state known to the journal. */
+typedef struct {
+    uint32_t    checksum;   // FNV-1a over the rest of the record
+    uint32_t    event;      // journal_event_e
+    uint64_t    seq;        // Record number, starts with 1
+    int32_t     client_id;  // Client that owns the job
+    int32_t     job_id;     // Client job id
+    int32_t     printer_id; // Printer of the job
+    int32_t     priority;   // Priority of the job
+    int32_t     status;     // Status of the job
+    int32_t     page_count; // Pages printed so far
+    int32_t     sub_id;     // Target of a fan-out job, 0 for a single job
+    int64_t     offset;     // Bytes of the file printed so far
+    uint64_t    token;      // Session token of the client
+    char        filename[256]; // File to print
+} journal_record_t;
+
+typedef struct journal journal_t;
+
+/* called by journal_replay for every unfinished job, in submission order */
+typedef void (*journal_replay_fn)(const journal_record_t *state, void *arg);
+
+/* opens (or creates) the journal and reads it, returns NULL on error */
+journal_t* journal_open(const char *path);
+
+/* hands the unfinished jobs found by journal_open to replay, which may append to the journal */
+void journal_replay(journal_t *journal, journal_replay_fn replay, void *arg);
+
+/* appends a record; with durable != 0 returns only after it is on disk. 0 or -1 */
+int journal_append(journal_t *journal, journal_record_t *record, int durable);
+
+/* highest client id found in the journal */
+int journal_max_client_id(journal_t *journal);
+
+/* syncs outstanding records, stops the flusher and closes the journal */
+void journal_close(journal_t *journal);
+
+#endif
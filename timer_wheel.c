@@ -0,0 +1,310 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include "timer_wheel.h"
+
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_LEVELS    4
+#define WHEEL_RANGE     (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+typedef struct {
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;       // Signalled when a timer is armed while the thread sleeps
+    pthread_t           tid;
+    uint64_t            now;        // All timers up to this tick have expired
+    list_head_t         slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t            occupied[WHEEL_LEVELS]; // Bit i set: slot i may hold timers
+    list_head_t         expired;    // Timers whose callbacks are due
+    wheel_timer_t      *running;    // Timer whose callback runs right now
+    pthread_cond_t      ran;        // Signalled when a callback has returned
+    int                 pending;    // Armed timers
+    int                 sleeping;   // The thread waits for cond
+    unsigned long long  fired;      // Callbacks run
+} wheel_t;
+
+static wheel_t *wheels = NULL;
+static int wheel_count = 0;
+static unsigned int tick_us = 100;
+static uint64_t start_us;           // Monotonic time of tick 0
+static void (*idle_fn)(void);       // Called before a thread sleeps
+
+static uint64_t clock_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t current_tick(void) {
+    return (clock_us() - start_us) / tick_us;
+}
+
+/* digit of a tick on the given level */
+static int digit(uint64_t tick, int level) {
+    return (tick >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+}
+
+/* level of a timer: the highest digit in which it differs from the current tick */
+static int level_of(wheel_t *wheel, uint64_t expires) {
+    uint64_t diff = expires ^ wheel->now;
+    int level = WHEEL_LEVELS - 1;
+    while(level > 0 && !(diff >> (level * WHEEL_BITS)))
+        level--;
+    return level;
+}
+
+/* puts a timer into its slot or the expired list, wheel locked */
+static void place(wheel_t *wheel, wheel_timer_t *timer) {
+    if(timer->expires <= wheel->now) {
+        list_add_tail(&timer->elem, &wheel->expired);
+        return;
+    }
+    int level = level_of(wheel, timer->expires);
+    int slot = digit(timer->expires, level);
+    list_add_tail(&timer->elem, &wheel->slots[level][slot]);
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+/* takes a pending timer out of the wheel, wheel locked */
+static void unplace(wheel_t *wheel, wheel_timer_t *timer) {
+    list_del(&timer->elem);
+    if(timer->expires <= wheel->now)
+        return;
+    int level = level_of(wheel, timer->expires);
+    int slot = digit(timer->expires, level);
+    if(list_empty(&wheel->slots[level][slot]))
+        wheel->occupied[level] &= ~(1ULL << slot);
+}
+
+/* places the timers of a slot again, relative to the current tick */
+static void cascade(wheel_t *wheel, int level, int slot) {
+    list_head_t *head = &wheel->slots[level][slot];
+    wheel->occupied[level] &= ~(1ULL << slot);
+    while(!list_empty(head)) {
+        wheel_timer_t *timer = (wheel_timer_t*)head->next;
+        list_del(&timer->elem);
+        place(wheel, timer);
+    }
+}
+
+/*
+   First tick at which the wheel has work: the next occupied slot of
+   the lowest level that has one. Slots of a level are always ahead of
+   the current digit, and everything on a lower level comes first.
+*/
+static uint64_t next_event(wheel_t *wheel) {
+    for(int level = 0; level < WHEEL_LEVELS; level++) {
+        int shift = level * WHEEL_BITS;
+        int from = digit(wheel->now, level) + 1;
+        uint64_t mask = from < WHEEL_SLOTS ? wheel->occupied[level] & (~0ULL << from) : 0;
+        if(mask) {
+            uint64_t round = wheel->now >> (shift + WHEEL_BITS) << (shift + WHEEL_BITS);
+            return round + ((uint64_t)__builtin_ctzll(mask) << shift);
+        }
+    }
+    return UINT64_MAX;
+}
+
+/* moves the wheel forward to the target tick, due timers go to the expired list */
+static void advance(wheel_t *wheel, uint64_t target) {
+    while(wheel->now < target) {
+        uint64_t next = next_event(wheel);
+        if(next > target) {
+            wheel->now = target;
+            return;
+        }
+        wheel->now = next;
+        // Bring down the slots whose lower digits all became zero, highest first
+        int level = 0;
+        while(level < WHEEL_LEVELS - 1 && digit(next, level) == 0)
+            level++;
+        for(; level > 0; level--)
+            cascade(wheel, level, digit(next, level));
+        cascade(wheel, 0, digit(next, 0));
+    }
+}
+
+/* waits for the cond until the given monotonic time, wheel locked */
+static void wait_until(wheel_t *wheel, uint64_t deadline_us) {
+    struct timespec ts;
+#ifdef __APPLE__
+    // No monotonic clock for condition variables: wait for the same span of wall clock time
+    struct timeval tv;
+    uint64_t now = clock_us();
+    gettimeofday(&tv, NULL);
+    deadline_us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec + (deadline_us > now ? deadline_us - now : 0);
+#endif
+    ts.tv_sec = deadline_us / 1000000;
+    ts.tv_nsec = (deadline_us % 1000000) * 1000;
+    pthread_cond_timedwait(&wheel->cond, &wheel->mutex, &ts);
+}
+
+/* runs the callbacks of a wheel's timers as they expire */
+static void* wheel_thread(void *arg) {
+    wheel_t *wheel = arg;
+
+    pthread_mutex_lock(&wheel->mutex);
+    while(1) {
+        advance(wheel, current_tick());
+        if(!list_empty(&wheel->expired)) {
+            wheel_timer_t *timer = (wheel_timer_t*)list_del(wheel->expired.next);
+            wheel->pending--;
+            wheel->fired++;
+            wheel->running = timer;
+            pthread_mutex_unlock(&wheel->mutex);
+            timer->fn(timer->arg);
+            pthread_mutex_lock(&wheel->mutex);
+            wheel->running = NULL;
+            pthread_cond_broadcast(&wheel->ran);
+            continue;
+        }
+
+        if(idle_fn) {
+            pthread_mutex_unlock(&wheel->mutex);
+            idle_fn();
+            pthread_mutex_lock(&wheel->mutex);
+            if(!list_empty(&wheel->expired) || next_event(wheel) <= current_tick())
+                continue;
+        }
+
+        uint64_t next = next_event(wheel);
+        wheel->sleeping = 1;
+        if(next == UINT64_MAX)
+            pthread_cond_wait(&wheel->cond, &wheel->mutex);
+        else
+            wait_until(wheel, start_us + next * tick_us);
+        wheel->sleeping = 0;
+    }
+    return NULL;
+}
+
+/* starts the given number of wheels with the given tick, 0 or -1 (errno set); */
+/* idle (may be NULL) is called by a wheel's thread whenever it is about to sleep */
+int timer_wheel_init(int count, unsigned int tick, void (*idle)(void)) {
+    pthread_condattr_t attr;
+
+    if(count < 1 || !(wheels = calloc(count, sizeof(wheel_t)))) {
+        errno = count < 1 ? EINVAL : ENOMEM;
+        return -1;
+    }
+    wheel_count = count;
+    tick_us = tick ? tick : 1;
+    idle_fn = idle;
+    start_us = clock_us();
+
+    pthread_condattr_init(&attr);
+#ifndef __APPLE__
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    for(int i = 0; i < count; i++) {
+        wheel_t *wheel = &wheels[i];
+        pthread_mutex_init(&wheel->mutex, NULL);
+        pthread_cond_init(&wheel->cond, &attr);
+        pthread_cond_init(&wheel->ran, NULL);
+        for(int level = 0; level < WHEEL_LEVELS; level++) {
+            for(int slot = 0; slot < WHEEL_SLOTS; slot++)
+                list_init(&wheel->slots[level][slot]);
+        }
+        list_init(&wheel->expired);
+
+        int error = pthread_create(&wheel->tid, NULL, wheel_thread, wheel);
+        if(error) {
+            errno = error;
+            return -1;
+        }
+        pthread_detach(wheel->tid);
+    }
+    pthread_condattr_destroy(&attr);
+    return 0;
+}
+
+/* sets up a timer on wheel (taken modulo the number of wheels) */
+void wheel_timer_init(wheel_timer_t *timer, int wheel, void (*fn)(void *arg), void *arg) {
+    list_init(&timer->elem);
+    timer->expires = 0;
+    timer->wheel = (unsigned int)wheel % wheel_count;
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+/* arms a timer, wheel locked */
+static void arm(wheel_t *wheel, wheel_timer_t *timer, unsigned long long delay_us) {
+    uint64_t now = current_tick();
+    if(now < wheel->now)
+        now = wheel->now;
+    timer->expires = now + (delay_us + tick_us - 1) / tick_us;
+    // Longer delays are cut to the range of the wheel
+    if(timer->expires > (wheel->now | (WHEEL_RANGE - 1)))
+        timer->expires = wheel->now | (WHEEL_RANGE - 1);
+    place(wheel, timer);
+    wheel->pending++;
+    if(wheel->sleeping)
+        pthread_cond_signal(&wheel->cond);
+}
+
+/* arms the timer to fire after delay_us, rearms it if it is pending */
+void wheel_timer_schedule(wheel_timer_t *timer, unsigned long long delay_us) {
+    wheel_t *wheel = &wheels[timer->wheel];
+    pthread_mutex_lock(&wheel->mutex);
+    if(!list_empty(&timer->elem)) {
+        unplace(wheel, timer);
+        wheel->pending--;
+    }
+    arm(wheel, timer, delay_us);
+    pthread_mutex_unlock(&wheel->mutex);
+}
+
+/* fires the timer as soon as possible unless it is pending already */
+void wheel_timer_kick(wheel_timer_t *timer) {
+    wheel_t *wheel = &wheels[timer->wheel];
+    pthread_mutex_lock(&wheel->mutex);
+    if(list_empty(&timer->elem))
+        arm(wheel, timer, 0);
+    pthread_mutex_unlock(&wheel->mutex);
+}
+
+/* disarms the timer; its callback may still be running */
+void wheel_timer_cancel(wheel_timer_t *timer) {
+    wheel_t *wheel = &wheels[timer->wheel];
+    pthread_mutex_lock(&wheel->mutex);
+    if(!list_empty(&timer->elem)) {
+        unplace(wheel, timer);
+        wheel->pending--;
+    }
+    pthread_mutex_unlock(&wheel->mutex);
+}
+
+/* disarms the timer and waits until its callback has returned, */
+/* so that the timer can be freed; not to be called from the callback */
+void wheel_timer_cancel_sync(wheel_timer_t *timer) {
+    wheel_t *wheel = &wheels[timer->wheel];
+    pthread_mutex_lock(&wheel->mutex);
+    if(!list_empty(&timer->elem)) {
+        unplace(wheel, timer);
+        wheel->pending--;
+    }
+    while(wheel->running == timer)
+        pthread_cond_wait(&wheel->ran, &wheel->mutex);
+    pthread_mutex_unlock(&wheel->mutex);
+}
+
+/* thread of a wheel (taken modulo the number of wheels) */
+pthread_t timer_wheel_thread(int wheel) {
+    return wheels[wheel % wheel_count].tid;
+}
+
+/* current statistics */
+void timer_wheel_stats(timer_wheel_stats_t *stats) {
+    stats->wheels = wheel_count;
+    stats->tick_us = tick_us;
+    stats->pending = 0;
+    stats->fired = 0;
+    for(int i = 0; i < wheel_count; i++) {
+        pthread_mutex_lock(&wheels[i].mutex);
+        stats->pending += wheels[i].pending;
+        stats->fired += wheels[i].fired;
+        pthread_mutex_unlock(&wheels[i].mutex);
+    }
+}
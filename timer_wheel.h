@@ -0,0 +1,60 @@
+
+/*
+   Hierarchical timer wheels.
+   Every wheel is serviced by one thread that runs the callbacks of its
+   expired timers, so a few threads can pace thousands of printers.
+   Four levels of 64 slots cover 2^24 ticks; a timer is kept on the
+   level of the highest tick digit in which it differs from the current
+   tick and moves down a level whenever the wheel reaches its slot.
+*/
+
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "dbllinklist.h"
+
+/* A timer, owned by the caller */
+typedef struct wheel_timer {
+    list_head_t     elem;       // Pointers into the slot of its wheel (empty if not pending)
+    uint64_t        expires;    // Tick at which the timer fires
+    int             wheel;      // Wheel the timer runs on
+    void          (*fn)(void *arg); // Called on the wheel's thread, without locks held
+    void*           arg;
+} wheel_timer_t;
+
+typedef struct {
+    int                 wheels;     // Wheels, one thread each
+    unsigned int        tick_us;    // Resolution
+    int                 pending;    // Armed timers
+    unsigned long long  fired;      // Callbacks run so far
+} timer_wheel_stats_t;
+
+/* starts the given number of wheels with the given tick, 0 or -1 (errno set); */
+/* idle (may be NULL) is called by a wheel's thread whenever it is about to sleep */
+int timer_wheel_init(int wheels, unsigned int tick_us, void (*idle)(void));
+
+/* sets up a timer on wheel (taken modulo the number of wheels) */
+void wheel_timer_init(wheel_timer_t *timer, int wheel, void (*fn)(void *arg), void *arg);
+
+/* arms the timer to fire after delay_us, rearms it if it is pending */
+void wheel_timer_schedule(wheel_timer_t *timer, unsigned long long delay_us);
+
+/* fires the timer as soon as possible unless it is pending already */
+void wheel_timer_kick(wheel_timer_t *timer);
+
+/* disarms the timer; its callback may still be running */
+void wheel_timer_cancel(wheel_timer_t *timer);
+
+/* disarms the timer and waits until its callback has returned, */
+/* so that the timer can be freed; not to be called from the callback */
+void wheel_timer_cancel_sync(wheel_timer_t *timer);
+
+/* thread of a wheel (taken modulo the number of wheels) */
+pthread_t timer_wheel_thread(int wheel);
+
+/* current statistics */
+void timer_wheel_stats(timer_wheel_stats_t *stats);
+
+#endif